@@ -0,0 +1,100 @@
+// -*- C++ -*-
+#ifndef ALAMEMP3ENCODER_ARCHIVE_H
+#define ALAMEMP3ENCODER_ARCHIVE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pthread_wrapper.h"
+
+namespace vscharf {
+
+// ======== exceptions ========
+class archive_error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// ======== classes ========
+// Packs many small outputs into a single file instead of one file
+// each. Layout (all integers little-endian):
+//   "LMP3ARC1"                                    header
+//   clip data ...                                 appended in any order
+//   index entries, sorted by name:
+//     u16 name length, name, u64 offset, u64 length, u32 duration (ms)
+//   u64 index offset, u32 entry count, "LMP3IDX1" footer
+// append() reserves its range with an atomic fetch_add on the end
+// offset and writes with pwrite, so any number of threads append
+// concurrently without a lock around the data.
+class ArchiveWriter {
+public:
+  // Creates (truncates) the archive at path. Throws posix_error.
+  explicit ArchiveWriter(const std::string& path);
+  // Calls finish().
+  ~ArchiveWriter();
+  ArchiveWriter(const ArchiveWriter&) = delete;
+  ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+  // Stores data under name. Thread-safe.
+  void append(const std::string& name, const std::string& data, uint32_t duration_ms);
+
+  // Writes the index. No append() must be running or follow.
+  void finish();
+
+private:
+  struct IndexEntry {
+    std::string name;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t duration_ms;
+  };
+
+  int fd_;
+  std::atomic<uint64_t> end_;
+  bool finished_ = false;
+  std::vector<IndexEntry> index_;
+  mutex_protected<std::vector<IndexEntry>> index_lock_;
+};
+
+// Looks up single clips of an archive written by ArchiveWriter. The
+// archive is mapped into memory, lookups return pointers into the
+// mapping without copying (binary search over the sorted index).
+// Objects of this class are thread-safe.
+class ArchiveReader {
+public:
+  struct Clip {
+    const char* data; // valid as long as the reader lives
+    std::size_t size;
+    uint32_t duration_ms;
+  };
+
+  // Maps the archive at path and parses its index. Throws
+  // posix_error or archive_error for a malformed archive.
+  explicit ArchiveReader(const std::string& path);
+  ~ArchiveReader();
+  ArchiveReader(const ArchiveReader&) = delete;
+  ArchiveReader& operator=(const ArchiveReader&) = delete;
+
+  // Returns false if there is no clip called name.
+  bool find(const std::string& name, Clip& clip) const;
+  std::size_t size() const { return entries_.size(); }
+
+private:
+  struct Entry {
+    const char* name; // points into the mapping
+    uint16_t name_size;
+    Clip clip;
+  };
+
+  const char* map_;
+  std::size_t map_size_;
+  std::vector<Entry> entries_; // sorted by name
+};
+
+} // namespace vscharf
+
+#endif // ALAMEMP3ENCODER_ARCHIVE_H
@@ -22,6 +22,8 @@ private:
 // ======== functions ========
 std::vector<std::string> directory_entries(std::string path);
 // [ argument taken by value as it is modified inside the function ]
+bool exists(const std::string& path);
+bool is_directory(const std::string& path);
 } // namespace vscharf
 
 #endif // ALAMEMP3ENCODER_DIRECTORY_H
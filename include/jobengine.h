@@ -0,0 +1,148 @@
+// -*- C++ -*-
+#ifndef ALAMEMP3ENCODER_JOBENGINE_H
+#define ALAMEMP3ENCODER_JOBENGINE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "pthread_wrapper.h"
+
+namespace vscharf {
+
+// ======== forward decl. ========
+class ArchiveWriter;
+class Journal;
+
+// ======== classes ========
+// Encodes WAV files to mp3 in a three stage pipeline:
+//
+//   readers --(loaded)--> encoders --(encoded)--> writers
+//
+// io_threads reader threads open, read and probe the inputs, each
+// keeping its share of io_depth files open with kernel readahead
+// requested, i.e. their I/O is in flight while the encoders work.
+// io_threads writer threads write the outputs. Only the encoder
+// threads touch lame, all file syscalls (which block, also the
+// opens) happen on the reader/writer threads, so up to io_threads
+// opens/writes are in progress at once independent of the number of
+// encoders. Outputs are written to a temporary file and renamed when
+// complete, so a crash never leaves a partial mp3. With an archive
+// the encoders append their outputs to it directly (lock-free, see
+// ArchiveWriter) and the writers are idle. Jobs may finish in any
+// order.
+//
+// If min_encoders < max_encoders the number of active encoders is
+// adjusted at runtime by hill climbing on the measured throughput
+// (seconds of audio encoded per second): the count is moved one step
+// at a time and the direction reversed whenever throughput drops.
+// max_encoders threads are created, the inactive ones are parked.
+// Objects of this class are not thread-safe, except where noted.
+class JobEngine {
+public:
+  struct Options {
+    int quality;        // lame quality setting
+    unsigned encoders;  // number of encoder (CPU) threads (initially)
+    unsigned io_depth;  // number of files prefetched by all readers
+    unsigned io_threads = 4; // number of reader and of writer threads
+    Journal* journal = nullptr; // records started/completed files if set
+    ArchiveWriter* archive = nullptr; // outputs go here instead of files if set
+    unsigned min_encoders = 0;  // bounds of the encoder count if max_encoders
+    unsigned max_encoders = 0;  // is set, autoscaling if min_encoders < max_encoders
+    unsigned scale_interval_ms = 2000; // measuring period of autoscaling
+  };
+
+  // A single file of a job.
+  struct Track {
+    std::string infile;
+    std::string outfile;
+    std::string data; // WAV contents after reading, mp3 after encoding
+    uint32_t duration_ms = 0; // set when encoded
+  };
+
+  // The unit of work travelling through the pipeline: either a single
+  // file or all tracks of a gapless album.
+  struct Job {
+    std::vector<Track> tracks;
+    bool gapless;
+  };
+
+  // Starts all threads.
+  explicit JobEngine(const Options& options);
+  // Calls finish().
+  ~JobEngine();
+  JobEngine(const JobEngine&) = delete;
+  JobEngine& operator=(const JobEngine&) = delete;
+
+  // Queues infile for encoding. The output file is placed next to it
+  // with the extension replaced by mp3.
+  void submit(std::string infile);
+
+  // Queues the infiles for gapless encoding as one continuous stream,
+  // in the given order. Each album is encoded on a single encoder
+  // thread, different albums run in parallel. Output files as for
+  // submit().
+  void submit_album(std::vector<std::string> infiles);
+
+  // Signals that no more jobs will be submitted and waits until all
+  // queued jobs are done. Further calls do nothing.
+  void finish();
+
+  // Thread-safe counters, in files (not jobs).
+  std::size_t succeeded() const { return succeeded_; }
+  std::size_t failed() const { return failed_; }
+  // Number of submitted jobs that are not yet done.
+  std::size_t pending() const {
+    const std::size_t done = succeeded_ + failed_; // read before submitted_count_
+    return submitted_count_ - done;
+  }
+
+  // Number of active encoder threads. Thread-safe.
+  unsigned encoders() { return active_encoders_.get(); }
+  // Seconds of audio encoded so far. Thread-safe.
+  double audio_seconds() const { return audio_ms_ / 1000.0; }
+
+  // Returns the messages of jobs failed since the last call.
+  // Thread-safe.
+  std::vector<std::string> take_errors();
+
+private:
+  static void* read_loop(void* self);
+  static void* encode_loop(void* self);
+  static void* write_loop(void* self);
+  static void* scale_loop(void* self);
+  void fail(const std::string& infile, const char* what, std::size_t nfiles = 1);
+  void encode_job(Job& job, std::size_t& current);
+  void store(Job& job);
+  void start_threads(std::vector<pthread_t>& threads, unsigned n, void* (*loop)(void*));
+
+  Options options_;
+  blocking_queue<Job> submitted_;
+  blocking_queue<Job> loaded_;
+  blocking_queue<Job> encoded_;
+
+  std::vector<pthread_t> readers_;
+  std::vector<pthread_t> encoders_;
+  std::vector<pthread_t> writers_;
+  std::atomic<unsigned> next_encoder_index_;
+  thread_limit active_encoders_;
+  pthread_t scaler_;
+  bool autoscale_;
+  std::atomic<bool> stop_scaling_;
+  bool finished_ = false;
+
+  std::atomic<uint64_t> audio_ms_;
+  std::atomic<std::size_t> submitted_count_;
+  std::atomic<std::size_t> succeeded_;
+  std::atomic<std::size_t> failed_;
+  std::vector<std::string> errors_;
+  mutex_protected<std::vector<std::string>> errors_lock_;
+};
+
+} // namespace vscharf
+
+#endif // ALAMEMP3ENCODER_JOBENGINE_H
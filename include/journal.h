@@ -0,0 +1,81 @@
+// -*- C++ -*-
+#ifndef ALAMEMP3ENCODER_JOURNAL_H
+#define ALAMEMP3ENCODER_JOURNAL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include "pthread_wrapper.h"
+
+namespace vscharf {
+
+// ======== functions ========
+// CRC-32 (IEEE 802.3) of data.
+uint32_t crc32(const std::string& data);
+
+// ======== classes ========
+// Append-only journal of started and completed jobs which allows to
+// resume an interrupted batch. Each line is one record:
+//   S <tab> infile
+//   D <tab> infile <tab> output size <tab> output crc32 (hex) <tab> output mtime (ns)
+// The mtime is missing in records written by older versions.
+// Records are buffered and written with a single fsync per batch,
+// i.e. after batch_size completions or once a second.
+// Before the completion records of a batch are written the outputs
+// are synced (one syncfs per filesystem holding outputs of the batch),
+// so a D record always refers to a durable output.
+// A torn last line (crash while appending) is ignored on replay.
+// All member functions are thread-safe.
+class Journal {
+public:
+  struct Entry {
+    uint64_t size;
+    uint32_t crc;
+    int64_t mtime; // ns since the epoch, 0 if unknown
+  };
+
+  // Replays and opens the journal at path, creating it if
+  // necessary. Records are synced after batch_size completions.
+  // Throws posix_error if the file can't be opened.
+  Journal(const std::string& path, std::size_t batch_size = 64);
+  // Calls flush().
+  ~Journal();
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  // True if infile was completed in a previous run and outfile still
+  // has the recorded size and mtime. Only if the size matches but the
+  // mtime doesn't (or wasn't recorded) outfile is read to compare the
+  // CRC-32.
+  bool completed(const std::string& infile, const std::string& outfile) const;
+
+  void started(const std::string& infile);
+  // data is the complete contents written to outfile, the output of
+  // infile.
+  void finished(const std::string& infile, const std::string& outfile, const std::string& data);
+
+  // Writes and syncs all buffered records.
+  void flush();
+
+private:
+  void replay(const std::string& path);
+  void flush_locked(std::string& pending);
+
+  std::unordered_map<std::string, Entry> replayed_;
+  std::size_t batch_size_;
+  int fd_;
+  // protected by pending_lock_
+  std::size_t pending_completions_ = 0;
+  std::chrono::steady_clock::time_point last_flush_;
+  std::set<std::string> pending_dirs_; // directories of the finished outputs
+  std::string pending_;
+  mutex_protected<std::string> pending_lock_;
+};
+
+} // namespace vscharf
+
+#endif // ALAMEMP3ENCODER_JOURNAL_H
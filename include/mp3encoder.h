@@ -37,12 +37,36 @@ public:
 
   // Encode the PCM data from in to the ostream output using nsamples at once.
   // By default nsamples is adjusted such that 4K bytes are read at once.
+  // Selects a loop specialised for the sample layout of in once per file.
   void encode(WavDecoder& in, std::ostream& output, uint32_t nsamples = 0);
 
+  // Same as encode but always uses the generic (runtime-dispatched) loop.
+  void encode_generic(WavDecoder& in, std::ostream& output, uint32_t nsamples = 0);
+
+  // Gapless encoding of consecutive tracks as one continuous lame
+  // stream. Call once per track in playing order, all tracks must
+  // have the same channels and sample rate; last has to be set for
+  // the final track. An encoder can't be used for encode() after
+  // this. Returns the LAME/Xing tag frame of the track (encoder delay
+  // and padding), which has to overwrite the first bytes of output.
+  char_buffer encode_gapless(WavDecoder& in, std::ostream& output, bool last,
+			     uint32_t nsamples = 0);
+
 private:
+  uint32_t init_params(const WavDecoder& in, uint32_t nsamples);
+  template<typename Format>
+  void encode_blocks(WavDecoder& in, std::ostream& output, uint32_t nsamples);
+  void encode_layout(WavDecoder& in, std::ostream& output, uint32_t nsamples);
+  void flush(std::ostream& output);
+  void flush_nogap(std::ostream& output);
+
   lame_global_flags* gfp_;
   int quality_;
   char_buffer buf_;
+  uint32_t gapless_tracks_ = 0; // tracks encoded so far by encode_gapless
+  uint32_t gapless_nsamples_ = 0;
+  uint16_t gapless_channels_ = 0;
+  uint32_t gapless_samplerate_ = 0;
 };
 
 } // namespace vscharf
@@ -4,6 +4,12 @@
 
 #include <pthread.h>
 
+#include <cassert>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <utility>
+
 namespace vscharf {
 // A scoped lock which allows access to an object of type T when
 // locked.
@@ -69,6 +75,134 @@ private:
   pthread_attr_t attr_;
 };
 
+// A FIFO queue of T's for handing work between threads. pop()
+// blocks while the queue is empty, push() blocks while it holds
+// capacity elements (capacity 0 = unbounded). After close() no more
+// elements can be pushed and pop() returns false once the queue is
+// drained.
+template<typename T>
+class blocking_queue {
+public:
+  explicit blocking_queue(std::size_t capacity = 0)
+    : mutex_(PTHREAD_MUTEX_INITIALIZER)
+    , not_empty_(PTHREAD_COND_INITIALIZER)
+    , not_full_(PTHREAD_COND_INITIALIZER)
+    , capacity_(capacity)
+  {}
+  ~blocking_queue() {
+    pthread_cond_destroy(&not_full_);
+    pthread_cond_destroy(&not_empty_);
+    pthread_mutex_destroy(&mutex_);
+  }
+  blocking_queue(const blocking_queue&) = delete;
+  blocking_queue& operator=(const blocking_queue&) = delete;
+
+  // Returns false (and drops t) if the queue has been closed.
+  bool push(T t) {
+    pthread_mutex_lock(&mutex_);
+    while(!closed_ && capacity_ && items_.size() >= capacity_) {
+      pthread_cond_wait(&not_full_, &mutex_);
+    }
+    const bool ok = !closed_;
+    if(ok) items_.push_back(std::move(t));
+    pthread_mutex_unlock(&mutex_);
+    if(ok) pthread_cond_signal(&not_empty_);
+    return ok;
+  }
+
+  // Blocks until an element is available. Returns false if the queue
+  // is closed and empty.
+  bool pop(T& t) {
+    pthread_mutex_lock(&mutex_);
+    while(!closed_ && items_.empty()) pthread_cond_wait(&not_empty_, &mutex_);
+    return take(t);
+  }
+
+  // Same as pop but never blocks.
+  bool try_pop(T& t) {
+    pthread_mutex_lock(&mutex_);
+    return take(t);
+  }
+
+  void close() {
+    pthread_mutex_lock(&mutex_);
+    closed_ = true;
+    pthread_mutex_unlock(&mutex_);
+    pthread_cond_broadcast(&not_empty_);
+    pthread_cond_broadcast(&not_full_);
+  }
+
+  std::size_t size() {
+    pthread_mutex_lock(&mutex_);
+    const std::size_t n = items_.size();
+    pthread_mutex_unlock(&mutex_);
+    return n;
+  }
+
+private:
+  // expects mutex_ to be locked, unlocks it
+  bool take(T& t) {
+    const bool ok = !items_.empty();
+    if(ok) {
+      t = std::move(items_.front());
+      items_.pop_front();
+    }
+    pthread_mutex_unlock(&mutex_);
+    if(ok) pthread_cond_signal(&not_full_);
+    return ok;
+  }
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t not_empty_;
+  pthread_cond_t not_full_;
+  std::size_t capacity_;
+  bool closed_ = false;
+  std::deque<T> items_;
+};
+
+// Lets the threads of a pool with an index below a limit pass, the
+// others wait until the limit is raised. Used to change the number
+// of active threads of a pool at runtime without creating/joining
+// threads.
+class thread_limit {
+public:
+  explicit thread_limit(unsigned limit)
+    : mutex_(PTHREAD_MUTEX_INITIALIZER)
+    , raised_(PTHREAD_COND_INITIALIZER)
+    , limit_(limit)
+  {}
+  ~thread_limit() {
+    pthread_cond_destroy(&raised_);
+    pthread_mutex_destroy(&mutex_);
+  }
+  thread_limit(const thread_limit&) = delete;
+  thread_limit& operator=(const thread_limit&) = delete;
+
+  void set(unsigned limit) {
+    pthread_mutex_lock(&mutex_);
+    limit_ = limit;
+    pthread_mutex_unlock(&mutex_);
+    pthread_cond_broadcast(&raised_);
+  }
+  unsigned get() {
+    pthread_mutex_lock(&mutex_);
+    const unsigned limit = limit_;
+    pthread_mutex_unlock(&mutex_);
+    return limit;
+  }
+  // blocks while index >= limit
+  void wait(unsigned index) {
+    pthread_mutex_lock(&mutex_);
+    while(index >= limit_) pthread_cond_wait(&raised_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+private:
+  pthread_mutex_t mutex_;
+  pthread_cond_t raised_;
+  unsigned limit_;
+};
+
 // // Encapsulates a condition using pthread condition variables.
 // template<typename T>
 // class condition_protected {
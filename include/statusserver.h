@@ -0,0 +1,41 @@
+// -*- C++ -*-
+#ifndef ALAMEMP3ENCODER_STATUSSERVER_H
+#define ALAMEMP3ENCODER_STATUSSERVER_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include <pthread.h>
+
+namespace vscharf {
+
+// ======== classes ========
+// Serves a status report on a local (unix domain) socket. Every
+// client connecting to the socket receives the result of report()
+// and is disconnected, e.g. `socat - UNIX-CONNECT:<path>`.
+// report() is called on the server thread.
+class StatusServer {
+public:
+  // Throws posix_error if the socket can't be created. A socket
+  // left at path by a previous run is replaced, any other existing
+  // file fails with EEXIST.
+  StatusServer(const std::string& path, std::function<std::string()> report);
+  // Stops the server thread and removes the socket file.
+  ~StatusServer();
+  StatusServer(const StatusServer&) = delete;
+  StatusServer& operator=(const StatusServer&) = delete;
+
+private:
+  static void* serve_loop(void* self);
+
+  std::string path_;
+  std::function<std::string()> report_;
+  int fd_;
+  std::atomic<bool> stop_;
+  pthread_t thread_;
+};
+
+} // namespace vscharf
+
+#endif // ALAMEMP3ENCODER_STATUSSERVER_H
@@ -0,0 +1,50 @@
+// -*- C++ -*-
+#ifndef ALAMEMP3ENCODER_WATCHER_H
+#define ALAMEMP3ENCODER_WATCHER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace vscharf {
+
+// ======== classes ========
+// Watches a directory (and optionally all its subdirectories) for
+// files that have been completely written, i.e. closed after writing
+// or moved into the directory. Uses inotify, only available on Linux.
+// Objects of this class are not thread-safe.
+class DirectoryWatcher {
+public:
+  // Throws posix_error if the directory can't be watched.
+  DirectoryWatcher(const std::string& path, bool recursive);
+  ~DirectoryWatcher();
+  DirectoryWatcher(const DirectoryWatcher&) = delete;
+  DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+  // Waits up to timeout_ms milliseconds (-1 = forever) for files to
+  // be completed and returns their paths. Returns an empty vector on
+  // timeout or if interrupted by a signal.
+  std::vector<std::string> wait(int timeout_ms);
+
+  // True if the kernel's event queue overflowed since the last call,
+  // i.e. completed files may be missing from the results of wait().
+  // The caller has to rescan the directory.
+  bool take_overflow();
+
+  // Paths of all watched directories.
+  std::vector<std::string> directories() const;
+
+private:
+  void add_watch(const std::string& path);
+
+  int fd_;
+  bool recursive_;
+  bool overflow_ = false;
+  std::string root_;
+  std::map<int, std::string> watches_; // watch descriptor -> directory
+  std::vector<char> buf_;
+};
+
+} // namespace vscharf
+
+#endif // ALAMEMP3ENCODER_WATCHER_H
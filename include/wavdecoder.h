@@ -2,6 +2,7 @@
 #ifndef ALAMEMP3ENCODER_WAVDECODER_H
 #define ALAMEMP3ENCODER_WAVDECODER_H
 
+#include <cstddef>
 #include <cstdint>
 #include <istream>
 #include <stdexcept>
@@ -9,6 +10,15 @@
 
 namespace vscharf {
 
+// ======== constants ========
+// Byte order of the host, known at compile time. RIFF/WAVE data is
+// always stored little-endian.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool host_little_endian = false;
+#else
+constexpr bool host_little_endian = true;
+#endif
+
 // ======== exceptions ========
 class decoder_error : public std::runtime_error {
 public:
@@ -16,7 +26,27 @@ public:
 };
 
 // ======== classes ========
+// Compile-time description of a PCM sample layout. Used to select the
+// specialised decode/encode loops once per file. The samples of the
+// file are always little-endian; HostLittleEndian is the byte order of
+// the machine decoding them, which decides if 16-bit samples have to
+// be swapped.
+template<uint16_t Bits, uint16_t Channels, bool HostLittleEndian = host_little_endian>
+struct PcmFormat {
+  static_assert(Bits == 8 || Bits == 16, "only 8-bit and 16-bit PCM");
+  static constexpr uint16_t bitsPerSample = Bits;
+  static constexpr uint16_t channels = Channels;
+  static constexpr uint32_t bytesPerSample = Bits / 8;
+  static constexpr bool needsSwap = Bits == 16 && !HostLittleEndian;
+};
+
 // Reads RIFF/WAVE files and decodes them into 16-bit signed PCM data.
+// The chunk table up to the first data chunk is parsed from a single
+// buffered read (refilled only if chunks before the data are larger
+// than the buffer). Chunk sizes are bounds-checked and odd-sized chunks
+// are followed by their pad byte. Data chunks are read in whole frames:
+// a partial frame at the end of a chunk and a truncated chunk at the
+// end of the file are dropped.
 // Objects of this class are not thread-safe.
 class WavDecoder {
 public:
@@ -34,26 +64,62 @@ public:
   WavDecoder(std::istream& in);
   
   const WavHeader& get_header() const { return header_; }
-  bool has_next() const { in_.peek(); return in_.good(); }
+  bool has_next() const { return head_pos_ < head_end_ || (in_.peek(), in_.good()); }
   // make sure eof is triggered --^
 
-  // Read up to nsamples samples (default = 1). The size of
+  // Read up to nsamples samples per channel. The size of
   // char_buffer will represent the actual number of samples read. The
   // reference is valid up to the next call to read_samples.
   // The buffer contains 16-bit resolution PCM samples.
   const char_buffer& read_samples(uint32_t nsamples);
 
+  // Same as above, but with the sample layout fixed at compile
+  // time. Format has to match get_header() (see matches()). Explicitly
+  // instantiated for 8/16-bit mono and stereo.
+  template<typename Format>
+  const char_buffer& read_samples(uint32_t nsamples);
+
+  // True if the decoded header has the layout described by Format.
+  template<typename Format>
+  bool matches() const {
+    return header_.bitsPerSample == Format::bitsPerSample &&
+      header_.channels == Format::channels &&
+      header_.bytesPerSample == Format::bytesPerSample;
+  }
+
 private:
   void decode_wav_header();
-  void skip_chunk();
-  void seek_data();
+  bool next_data_chunk();
+  std::size_t read_bytes(char* dst, std::size_t n);
+  void skip_bytes(uint64_t n);
+  uint32_t read_frames(char* dst, uint32_t frames, uint32_t frame_bytes);
 
   WavHeader header_;
   std::istream& in_; // mutable to allow has_next to peek
   char_buffer buf_;
+  std::vector<unsigned char> raw_; // staging buffer for 8-bit samples
   uint32_t remaining_chunk_size_ = 0;
+  bool chunk_padded_ = false; // the current chunk is followed by a pad byte
+  char head_[4096]; // the header read, consumed before in_
+  std::size_t head_pos_ = 0;
+  std::size_t head_end_ = 0;
+};
+
+// Format and length of a WAV file, see probe_wav().
+struct WavInfo {
+  WavDecoder::WavHeader header;
+  uint64_t frames;      // samples per channel in all data chunks
+  uint32_t duration_ms;
 };
 
+// ======== functions ========
+// Determines format and length of the complete WAV file in data
+// without decoding it: only the chunk table is walked, no memory is
+// allocated. Accepts and rejects exactly the files WavDecoder does,
+// frames is the number of frames WavDecoder will return. Throws
+// decoder_error with the same messages as WavDecoder.
+WavInfo probe_wav(const char* data, std::size_t size);
+
 } // namespace vscharf
 
 #endif // ALAMEMP3ENCODER_WAVDECODER_H
@@ -0,0 +1,311 @@
+#include "archive.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "directory.h" // posix_error
+
+#ifndef WINDOWS
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace vscharf {
+
+// ======== helper functions ========
+namespace {
+
+const char HEADER_MAGIC[] = "LMP3ARC1";
+const char FOOTER_MAGIC[] = "LMP3IDX1";
+const std::size_t MAGIC_SIZE = 8;
+const std::size_t FOOTER_SIZE = 8 + 4 + MAGIC_SIZE;
+const std::size_t MIN_ENTRY_SIZE = 2 + 8 + 8 + 4; // with an empty name
+
+void put(std::string& s, uint64_t v, int bytes)
+{
+  for(int i = 0; i < bytes; ++i) s += static_cast<char>((v >> (8*i)) & 0xFF);
+}
+
+uint64_t get(const char* p, int bytes)
+{
+  uint64_t v = 0;
+  for(int i = 0; i < bytes; ++i) v |= uint64_t(static_cast<unsigned char>(p[i])) << (8*i);
+  return v;
+}
+
+#ifndef WINDOWS
+void write_at(int fd, const char* p, std::size_t n, uint64_t offset)
+{
+  while(n) {
+    const ssize_t w = pwrite(fd, p, n, offset);
+    if(w < 0 && errno == EINTR) continue;
+    if(w < 0) throw posix_error(errno);
+    p += w;
+    n -= w;
+    offset += w;
+  }
+}
+#endif
+
+} // anonymous namespace
+
+#ifndef WINDOWS
+// ======== ArchiveWriter ========
+ArchiveWriter::ArchiveWriter(const std::string& path)
+  : fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))
+  , end_(MAGIC_SIZE)
+  , index_lock_(index_)
+{
+  if(fd_ < 0) throw posix_error(errno);
+  try {
+    write_at(fd_, HEADER_MAGIC, MAGIC_SIZE, 0);
+  } catch(...) {
+    close(fd_);
+    throw;
+  }
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+  try {
+    finish();
+  } catch(const posix_error&) {
+    // destructor must never fail, the archive stays without index
+  }
+  close(fd_);
+}
+
+void ArchiveWriter::append(const std::string& name, const std::string& data, uint32_t duration_ms)
+{
+  if(name.size() > 0xFFFF) throw archive_error("Name too long for archive: " + name);
+  const uint64_t offset = end_.fetch_add(data.size());
+  write_at(fd_, data.data(), data.size(), offset);
+
+  IndexEntry e = { name, offset, data.size(), duration_ms };
+  auto lock = index_lock_.acquire();
+  lock.get().push_back(std::move(e));
+}
+
+void ArchiveWriter::finish()
+{
+  if(finished_) return;
+  finished_ = true;
+
+  std::sort(index_.begin(), index_.end(),
+	    [](const IndexEntry& a, const IndexEntry& b) { return a.name < b.name; });
+  std::string index;
+  for(const auto& e : index_) {
+    put(index, e.name.size(), 2);
+    index += e.name;
+    put(index, e.offset, 8);
+    put(index, e.length, 8);
+    put(index, e.duration_ms, 4);
+  }
+  const uint64_t index_offset = end_;
+  put(index, index_offset, 8);
+  put(index, index_.size(), 4);
+  index.append(FOOTER_MAGIC, MAGIC_SIZE);
+  write_at(fd_, index.data(), index.size(), index_offset);
+  if(ftruncate(fd_, index_offset + index.size())) throw posix_error(errno);
+}
+
+// ======== ArchiveReader ========
+ArchiveReader::ArchiveReader(const std::string& path)
+  : map_(nullptr)
+  , map_size_(0)
+{
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) throw posix_error(errno);
+  struct stat st;
+  if(fstat(fd, &st)) {
+    const int err = errno;
+    close(fd);
+    throw posix_error(err);
+  }
+  map_size_ = st.st_size;
+  if(map_size_ < MAGIC_SIZE + FOOTER_SIZE) {
+    close(fd);
+    throw archive_error("Not an archive: " + path);
+  }
+  void* m = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+  const int err = errno;
+  close(fd); // the mapping stays valid
+  if(m == MAP_FAILED) throw posix_error(err);
+  map_ = static_cast<const char*>(m);
+
+  try {
+    // the index is parsed with bounds checks, clips are never touched
+    const char* footer = map_ + map_size_ - FOOTER_SIZE;
+    if(std::memcmp(map_, HEADER_MAGIC, MAGIC_SIZE) ||
+       std::memcmp(footer + 12, FOOTER_MAGIC, MAGIC_SIZE)) {
+      throw archive_error("Not an archive: " + path);
+    }
+    const uint64_t index_offset = get(footer, 8);
+    const uint32_t count = get(footer + 8, 4);
+    if(index_offset < MAGIC_SIZE || index_offset > map_size_ - FOOTER_SIZE ||
+       count > (map_size_ - FOOTER_SIZE - index_offset) / MIN_ENTRY_SIZE) {
+      throw archive_error("Corrupt archive index: " + path);
+    }
+
+    const char* p = map_ + index_offset;
+    entries_.reserve(count);
+    for(uint32_t i = 0; i < count; ++i) {
+      if(footer - p < 2) throw archive_error("Corrupt archive index: " + path);
+      Entry e;
+      e.name_size = get(p, 2);
+      if(static_cast<std::size_t>(footer - p) < 2u + e.name_size + 20u) {
+	throw archive_error("Corrupt archive index: " + path);
+      }
+      e.name = p + 2;
+      p += 2 + e.name_size;
+      const uint64_t offset = get(p, 8);
+      const uint64_t length = get(p + 8, 8);
+      e.clip.duration_ms = get(p + 16, 4);
+      p += 20;
+      if(offset < MAGIC_SIZE || offset > index_offset || length > index_offset - offset) {
+	throw archive_error("Corrupt archive index: " + path);
+      }
+      e.clip.data = map_ + offset;
+      e.clip.size = length;
+      entries_.push_back(e);
+    }
+  } catch(...) {
+    munmap(const_cast<char*>(map_), map_size_);
+    throw;
+  }
+}
+
+ArchiveReader::~ArchiveReader()
+{
+  munmap(const_cast<char*>(map_), map_size_);
+}
+
+bool ArchiveReader::find(const std::string& name, Clip& clip) const
+{
+  auto less = [](const Entry& e, const std::string& n) {
+    return std::lexicographical_compare(e.name, e.name + e.name_size, n.begin(), n.end());
+  };
+  const auto it = std::lower_bound(entries_.begin(), entries_.end(), name, less);
+  if(it == entries_.end() || it->name_size != name.size() ||
+     !std::equal(name.begin(), name.end(), it->name)) {
+    return false;
+  }
+  clip = it->clip;
+  return true;
+}
+#else
+ArchiveWriter::ArchiveWriter(const std::string&) : fd_(-1), end_(0), index_lock_(index_)
+{
+  throw archive_error("Archives are not supported on Windows");
+}
+ArchiveWriter::~ArchiveWriter() {}
+void ArchiveWriter::append(const std::string&, const std::string&, uint32_t) {}
+void ArchiveWriter::finish() {}
+
+ArchiveReader::ArchiveReader(const std::string&) : map_(nullptr), map_size_(0)
+{
+  throw archive_error("Archives are not supported on Windows");
+}
+ArchiveReader::~ArchiveReader() {}
+bool ArchiveReader::find(const std::string&, Clip&) const { return false; }
+#endif // WINDOWS
+
+} // namespace vscharf
+
+#ifdef TEST_ARCHIVE
+// some basic unit testing
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <pthread.h>
+#include <sys/resource.h>
+
+namespace {
+vscharf::ArchiveWriter* shared_writer = nullptr;
+
+void* append_many(void* arg)
+{
+  const long id = reinterpret_cast<long>(arg);
+  for(int i = 0; i < 100; ++i) {
+    const std::string name = "t" + std::to_string(id) + "/" + std::to_string(i) + ".mp3";
+    shared_writer->append(name, std::string(i + 1, char('a' + id)), i);
+  }
+  return nullptr;
+}
+} // anonymous namespace
+
+int main()
+{
+  char tmpl[] = "/tmp/archive_test_XXXXXX";
+  const int fd = mkstemp(tmpl);
+  close(fd);
+  const std::string path = tmpl;
+
+  {
+    vscharf::ArchiveWriter w(path);
+    shared_writer = &w;
+    pthread_t threads[4];
+    for(long t = 0; t < 4; ++t) pthread_create(&threads[t], nullptr, append_many, reinterpret_cast<void*>(t));
+    for(auto& t : threads) pthread_join(t, nullptr);
+    w.append("empty.mp3", "", 0);
+  }
+
+  {
+    vscharf::ArchiveReader r(path);
+    assert(r.size() == 401);
+    vscharf::ArchiveReader::Clip clip;
+    for(long t = 0; t < 4; ++t) {
+      for(int i = 0; i < 100; ++i) {
+	const std::string name = "t" + std::to_string(t) + "/" + std::to_string(i) + ".mp3";
+	assert(r.find(name, clip));
+	assert(clip.size == std::size_t(i + 1));
+	assert(clip.duration_ms == uint32_t(i));
+	assert(std::string(clip.data, clip.size) == std::string(i + 1, char('a' + t)));
+      }
+    }
+    assert(r.find("empty.mp3", clip) && clip.size == 0);
+    assert(!r.find("t0/100.mp3", clip));
+    assert(!r.find("", clip));
+  }
+
+  {
+    // an entry count larger than the index is rejected before anything
+    // is allocated for it
+    struct stat st;
+    stat(path.c_str(), &st);
+    const int fd = open(path.c_str(), O_WRONLY);
+    const char count[4] = { '\xff', '\xff', '\xff', '\x7f' };
+    assert(pwrite(fd, count, sizeof(count), st.st_size - 12) == sizeof(count)); // footer: offset, count, magic
+    close(fd);
+    // make the allocation fail for sure (instead of being overcommitted)
+    rlimit old_limit;
+    getrlimit(RLIMIT_AS, &old_limit);
+    rlimit limit = old_limit;
+    limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, rlim_t(4) << 30);
+    setrlimit(RLIMIT_AS, &limit);
+    try {
+      vscharf::ArchiveReader r(path);
+      assert(false && "Expected exception");
+    } catch(const vscharf::archive_error&) {
+    }
+    setrlimit(RLIMIT_AS, &old_limit);
+  }
+
+  {
+    // truncated archives are rejected
+    truncate(path.c_str(), 100);
+    try {
+      vscharf::ArchiveReader r(path);
+      assert(false && "Expected exception");
+    } catch(const vscharf::archive_error&) {
+    }
+  }
+
+  std::remove(path.c_str());
+  std::cout << "Test finished successfully!" << std::endl;
+  return 0;
+}
+#endif // TEST_ARCHIVE
@@ -1,98 +1,434 @@
 #include <algorithm>
-#include <array>
-#include <cassert>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "archive.h"
 #include "directory.h"
-#include "mp3encoder.h"
-#include "pthread_wrapper.h"
-#include "wavdecoder.h"
+#include "jobengine.h"
+#include "journal.h"
+#include "statusserver.h"
+#include "watcher.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace vscharf;
 
 const int QUALITY = 2; // recommended (good) quality setting
 const int NTHREADS = 4;
+const int IO_DEPTH = 256; // files kept in flight by the readers
+const int IO_THREADS = 4; // reader and writer threads each
+const int WATCH_TIMEOUT_MS = 500; // how often the daemon checks for signals
+
+namespace {
+volatile std::sig_atomic_t stop_requested = 0;
+
+extern "C" void request_stop(int) { stop_requested = 1; }
+
+bool is_wav(const std::string& entry)
+{
+  return entry.size() > 4 && entry.substr(entry.size() - 4) == ".wav";
+}
+
+bool is_dot_entry(const std::string& entry)
+{
+  const auto slash = entry.find_last_of("/\\");
+  const std::string name = entry.substr(slash == std::string::npos ? 0 : slash + 1);
+  return name == "." || name == "..";
+}
+
+// Appends the WAV files in dir (and its subdirectories if recursive)
+// to wav_files.
+void find_wav_files(const std::string& dir, bool recursive, std::vector<std::string>& wav_files)
+{
+  const auto& dir_entries = directory_entries(dir);
+  std::copy_if(std::begin(dir_entries), std::end(dir_entries),
+	       std::back_inserter(wav_files), is_wav);
+  if(!recursive) return;
+  for(const auto& entry : dir_entries) {
+    if(!is_dot_entry(entry) && is_directory(entry)) find_wav_files(entry, true, wav_files);
+  }
+}
+
+// Groups the WAV files by directory, each group sorted by name.
+std::vector<std::vector<std::string>> albums_of(const std::vector<std::string>& wav_files)
+{
+  std::map<std::string, std::vector<std::string>> by_dir;
+  for(const auto& f : wav_files) {
+    const auto slash = f.find_last_of("/\\");
+    by_dir[f.substr(0, slash == std::string::npos ? 0 : slash)].push_back(f);
+  }
+  std::vector<std::vector<std::string>> albums;
+  for(auto& d : by_dir) {
+    std::sort(d.second.begin(), d.second.end());
+    albums.push_back(std::move(d.second));
+  }
+  return albums;
+}
+
+std::string mp3_name(std::string wav)
+{
+  wav.replace(wav.size() - 3, 3, "mp3");
+  return wav;
+}
+
+// Parses a positive number given as value of option opt. Returns 0
+// on error.
+unsigned parse_count(const char* prog, const char* opt, const char* value)
+{
+  char* end = nullptr;
+  long n = value ? std::strtol(value, &end, 10) : 0;
+  if(!value || *end || n <= 0) {
+    std::cerr << prog << ": option " << opt << " needs a positive number" << std::endl;
+    return 0;
+  }
+  return n;
+}
+
+// True if the output of infile is complete: recorded in the journal
+// if there is one, otherwise it simply exists.
+bool is_done(const std::string& infile, const Journal* journal)
+{
+  return journal ? journal->completed(infile, mp3_name(infile)) : exists(mp3_name(infile));
+}
+
+// CPUs granted by the quota of the cgroup directory dir (cgroup v2
+// cpu.max or v1 cpu.cfs_quota_us), rounded up. 0 if unlimited.
+unsigned cgroup_quota(const std::string& dir, bool v2)
+{
+  std::string quota;
+  long period = 0;
+  if(v2) {
+    std::ifstream f(dir + "/cpu.max"); // "<quota> <period>" or "max <period>"
+    if(!(f >> quota >> period)) return 0;
+  } else {
+    std::ifstream q(dir + "/cpu.cfs_quota_us"); // -1 means unlimited
+    std::ifstream p(dir + "/cpu.cfs_period_us");
+    if(!(q >> quota && p >> period)) return 0;
+  }
+  const long q = std::strtol(quota.c_str(), nullptr, 10);
+  if(quota == "max" || q <= 0 || period <= 0) return 0;
+  return std::max(1L, (q + period - 1) / period);
+}
+
+// Finds the cgroup of this process holding the CPU controller in
+// /proc/self/cgroup. A v1 cpu hierarchy wins over the v2 one (hybrid
+// setups). False if there is none.
+bool own_cgroup(std::string& path, bool& v2)
+{
+  std::ifstream in("/proc/self/cgroup");
+  std::string line;
+  bool found = false;
+  while(std::getline(in, line)) {
+    // hierarchy-ID:controller-list:cgroup-path
+    const auto id_end = line.find(':');
+    const auto list_end = id_end == std::string::npos ? id_end : line.find(':', id_end + 1);
+    if(list_end == std::string::npos) continue;
+    const std::string controllers = ',' + line.substr(id_end + 1, list_end - id_end - 1) + ',';
+    if(controllers.find(",cpu,") != std::string::npos) {
+      path = line.substr(list_end + 1);
+      v2 = false;
+      return true;
+    }
+    if(line.compare(0, id_end, "0") == 0 && controllers == ",,") {
+      path = line.substr(list_end + 1);
+      v2 = found = true;
+    }
+  }
+  return found;
+}
+
+// Number of CPUs this process may use, taking the affinity mask and
+// the CPU quotas of its cgroup and all parent cgroups into account.
+// Returns 0 if unknown.
+unsigned cpu_limit()
+{
+  unsigned n = 0;
+#ifdef __linux__
+  cpu_set_t set;
+  if(!sched_getaffinity(0, sizeof(set), &set)) n = CPU_COUNT(&set);
+
+  std::string path;
+  bool v2 = false;
+  if(!own_cgroup(path, v2)) return n;
+  const std::string root = v2 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/cpu";
+  // in a cgroup namespace path is "/", i.e. the root is our own cgroup
+  for(;;) {
+    if(path == "/") path.clear();
+    const unsigned quota_cpus = cgroup_quota(root + path, v2);
+    if(quota_cpus) n = n ? std::min(n, quota_cpus) : quota_cpus;
+    if(path.empty()) break;
+    path.erase(path.rfind('/'));
+  }
+#endif
+  return n;
+}
+
+// Lowers the CPU (and optionally I/O) priority of the process. Must
+// be called before any thread is created, as on Linux the priorities
+// are per thread and inherited by new threads.
+bool lower_priority(int nice, bool idle_io)
+{
+#ifdef __linux__
+  if(nice && setpriority(PRIO_PROCESS, 0, nice)) return false;
+  const int IOPRIO_WHO_PROCESS = 1;
+  const int IOPRIO_CLASS_IDLE = 3;
+  const int IOPRIO_CLASS_SHIFT = 13;
+  if(idle_io && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)) return false;
+  return true;
+#else
+  return !nice && !idle_io;
+#endif
+}
+
+void print_errors(JobEngine& engine)
+{
+  for(const auto& e : engine.take_errors()) std::cerr << e << std::endl;
+}
+
+// Encodes all WAV files in dir once. With albums all WAV files of a
+// directory are encoded gaplessly in the order of their names. With
+// a journal, files (albums) completed by a previous run are skipped.
+int run_batch(const std::string& dir, bool recursive, bool albums,
+	      const JobEngine::Options& options)
+{
+  std::vector<std::string> wav_files;
+  find_wav_files(dir, recursive, wav_files);
+  const Journal* journal = options.journal;
+  std::size_t skipped = 0;
+
+  // do the work in the reader/encoder/writer pipeline
+  JobEngine engine(options);
+  if(albums) {
+    for(auto& a : albums_of(wav_files)) {
+      // an album can only be resumed as a whole, the encoder state at
+      // a track boundary isn't recorded
+      if(journal && std::all_of(a.begin(), a.end(),
+				[journal](const std::string& f) { return is_done(f, journal); })) {
+	skipped += a.size();
+	continue;
+      }
+      engine.submit_album(std::move(a));
+    }
+  } else {
+    for(auto& f : wav_files) {
+      if(journal && is_done(f, journal)) {
+	++skipped;
+	continue;
+      }
+      engine.submit(std::move(f));
+    }
+  }
+  engine.finish();
+
+  print_errors(engine);
+  if(skipped) std::cout << "Skipped " << skipped << " WAV files completed by a previous run." << std::endl;
+  std::cout << "Successfully converted " << engine.succeeded() << " WAV files to mp3." << std::endl;
+  return engine.failed() ? 5 : 0;
+}
+
+// Submits all WAV files below dir which have no output yet.
+void submit_unfinished(JobEngine& engine, const std::string& dir, bool recursive, const Journal* journal)
+{
+  std::vector<std::string> wav_files;
+  find_wav_files(dir, recursive, wav_files);
+  for(auto& f : wav_files) {
+    if(!is_done(f, journal)) engine.submit(std::move(f));
+  }
+}
+
+// Encodes every WAV file written to dir until SIGINT/SIGTERM. Files
+// present at startup are encoded if they have no mp3 yet.
+int run_daemon(const std::string& dir, bool recursive, const std::string& status_path,
+	       const JobEngine::Options& options)
+{
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+
+  // watch first so that no file written during the initial scan is missed
+  DirectoryWatcher watcher(dir, recursive);
+  JobEngine engine(options);
+
+  std::unique_ptr<StatusServer> status;
+  if(!status_path.empty()) {
+    status.reset(new StatusServer(status_path, [&engine]() {
+	  std::ostringstream report;
+	  report << "queued " << engine.pending() << '\n'
+		 << "encoders " << engine.encoders() << '\n'
+		 << "succeeded " << engine.succeeded() << '\n'
+		 << "failed " << engine.failed() << '\n';
+	  return report.str();
+	}));
+  }
+
+  submit_unfinished(engine, dir, recursive, options.journal);
 
-// Function for encoding a file taken from the (condition-protected)
-// list of files-names available_files. After no file is left
-// decreases the (again condition-protected) number of available
-// threads.
-namespace EncodeFiles {
-  void* do_work(void* args)
-  {
-    using value_type = std::vector<std::string>;
-    auto& available_files = *((mutex_protected<value_type>*)args);
-    while(1) {
-      scoped_lock<value_type> lock = available_files.acquire();
-      if(lock.get().empty()) return nullptr; // no more work to do
-      
-      auto infilename = lock.get().back();
-      lock.get().pop_back();
-      lock.unlock();
-
-      // do the encoding
-      std::string outfilename(infilename);
-      outfilename.replace(outfilename.size() - 3, 3, "mp3");
-      
-      std::ifstream infile(infilename);
-      std::ofstream outfile(outfilename);
-
-      WavDecoder wav(infile);
-      Mp3Encoder mp3(QUALITY);
-      mp3.encode(wav, outfile);
+  while(!stop_requested) {
+    for(auto& f : watcher.wait(WATCH_TIMEOUT_MS)) {
+      if(is_wav(f)) engine.submit(std::move(f));
+    }
+    if(watcher.take_overflow()) {
+      // events were lost: pick up every file without an output (files
+      // still queued may be encoded twice, which is harmless)
+      std::cerr << "Event queue overflowed, rescanning " << dir << std::endl;
+      submit_unfinished(engine, dir, recursive, options.journal);
     }
-    // not reachable
-    return nullptr;
-  } // do_work
-} // namespace EncodeFiles
+    print_errors(engine);
+    if(options.journal) options.journal->flush(); // don't keep records back while idle
+  }
+
+  engine.finish();
+  print_errors(engine);
+  std::cout << "Successfully converted " << engine.succeeded() << " WAV files to mp3." << std::endl;
+  return 0;
+}
+} // anonymous namespace
 
+// usage: a-lame-mp3-encoder [-j encoders] [-A min:max] [-n nice] [-I]
+//                           [-d io-depth] [-t io-threads] [-r]
+//                           [-J journal | -o archive]
+//                           [-a | -w [-s status-socket]] <directory>
+//   -r  include subdirectories
+//   -J  record progress in journal and skip files completed before
+//   -o  pack all mp3 outputs into one indexed archive file
+//   -A  adjust the number of encoders between min and max at runtime
+//   -n  run with the given nice level, -I with idle I/O priority
+//   -a  encode the WAV files of each directory as a gapless album
+//   -w  keep running and encode new WAV files as they are written
 int main(int argc, char* argv[])
 {
-  if(argc < 2) {
+  JobEngine::Options options;
+  options.quality = QUALITY;
+  options.encoders = NTHREADS;
+  options.io_depth = IO_DEPTH;
+  options.io_threads = IO_THREADS;
+  bool recursive = false;
+  bool daemon = false;
+  bool albums = false;
+  std::string status_path;
+  std::string journal_path;
+  std::string archive_path;
+  int nice = 0;
+  bool idle_io = false;
+
+  std::vector<std::string> operands;
+  for(int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    if(arg == "-j" || arg == "-d" || arg == "-t") {
+      const char* value = ++i < argc ? argv[i] : nullptr;
+      const unsigned n = parse_count(argv[0], arg.c_str(), value);
+      if(!n) return 4;
+      (arg == "-j" ? options.encoders : arg == "-d" ? options.io_depth : options.io_threads) = n;
+    } else if(arg == "-s" || arg == "-J" || arg == "-o") {
+      if(++i == argc) {
+	std::cerr << argv[0] << ": option " << arg << " needs a path" << std::endl;
+	return 4;
+      }
+      (arg == "-s" ? status_path : arg == "-J" ? journal_path : archive_path) = argv[i];
+    } else if(arg == "-A") {
+      const char* value = ++i < argc ? argv[i] : nullptr;
+      const char* colon = value ? std::strchr(value, ':') : nullptr;
+      if(!colon || !(options.min_encoders = parse_count(argv[0], "-A", std::string(value, colon).c_str())) ||
+	 !(options.max_encoders = parse_count(argv[0], "-A", colon + 1))) {
+	std::cerr << argv[0] << ": option -A needs min:max" << std::endl;
+	return 4;
+      }
+      if(options.min_encoders > options.max_encoders) {
+	std::cerr << argv[0] << ": option -A needs min <= max" << std::endl;
+	return 4;
+      }
+    } else if(arg == "-n") {
+      char* end = nullptr;
+      const char* value = ++i < argc ? argv[i] : nullptr;
+      nice = value ? std::strtol(value, &end, 10) : 0;
+      if(!value || *end) {
+	std::cerr << argv[0] << ": option -n needs a nice level" << std::endl;
+	return 4;
+      }
+    } else if(arg == "-I") {
+      idle_io = true;
+    } else if(arg == "-r") {
+      recursive = true;
+    } else if(arg == "-w") {
+      daemon = true;
+    } else if(arg == "-a") {
+      albums = true;
+    } else {
+      operands.push_back(arg);
+    }
+  }
+
+  if(operands.size() < 1) {
     std::cerr << argv[0] << ": missing directory operand" << std::endl;
     return 1;
-  } else if(argc > 2) {
+  } else if(operands.size() > 1) {
     std::cerr << argv[0] << ": too many directory operands" << std::endl;
     return 2;
   }
 
-  std::string dir(argv[1]);
-  std::vector<std::string> wav_files;
-  const auto& dir_entries = directory_entries(dir);
-  std::copy_if(std::begin(dir_entries), std::end(dir_entries),
-	       std::back_inserter(wav_files),
-	       [](const std::string& entry) -> bool {
-		 return entry.size() > 4 &&
-		   entry.substr(entry.size() - 4) == ".wav";
-	       });
-
-
-  // mutex protected list of remaining files
-  const std::size_t n_wav_files = wav_files.size();
-  mutex_protected<std::vector<std::string>> available_files(wav_files);
-
-  // do the work on (joinable) threads
-  scoped_pthread_attr attr;
-  pthread_attr_setdetachstate(attr.get(), PTHREAD_CREATE_JOINABLE);
-  std::array<pthread_t, NTHREADS> threads;
-  for(auto& t : threads) {
-    int rc = pthread_create(&t, attr.get(), EncodeFiles::do_work, (void*)&available_files);
-    if(rc) {
-      std::cerr << "Couldn't create thread with error " << rc << std::endl;
-      return 3;
-    }
+  if(daemon && albums) {
+    std::cerr << argv[0] << ": options -a and -w can't be combined" << std::endl;
+    return 4;
   }
-
-  // wait for all threads to finish
-  for(auto& t : threads) {
-    pthread_join(t, nullptr); // ignore error code as we will exit anyways
+  if(!journal_path.empty() && !archive_path.empty()) {
+    // a new archive starts empty, there is nothing to resume
+    std::cerr << argv[0] << ": options -J and -o can't be combined" << std::endl;
+    return 4;
+  }
+  if(daemon && !archive_path.empty()) {
+    // the archive is recreated on every start and only readable after
+    // a clean exit, both don't fit a long-running daemon
+    std::cerr << argv[0] << ": options -o and -w can't be combined" << std::endl;
+    return 4;
   }
 
-  std::cout << "Successfully converted " << n_wav_files << " WAV files to mp3." << std::endl;
+  // don't start more encoders than the CPU quota allows; a range
+  // collapsed by the clamp fixes the count at the limit
+  const unsigned cpus = cpu_limit();
+  if(cpus) {
+    options.encoders = std::min(options.encoders, cpus);
+    options.min_encoders = std::min(options.min_encoders, cpus);
+    options.max_encoders = std::min(options.max_encoders, cpus);
+  }
+  if(!lower_priority(nice, idle_io)) {
+    std::cerr << argv[0] << ": couldn't change the priority" << std::endl;
+  }
 
-  return 0;
+  try {
+    std::unique_ptr<Journal> journal;
+    if(!journal_path.empty()) {
+      journal.reset(new Journal(journal_path));
+      options.journal = journal.get();
+    }
+    std::unique_ptr<ArchiveWriter> archive;
+    if(!archive_path.empty()) {
+      archive.reset(new ArchiveWriter(archive_path));
+      options.archive = archive.get();
+    }
+    const int rc = daemon ? run_daemon(operands[0], recursive, status_path, options)
+      : run_batch(operands[0], recursive, albums, options);
+    if(archive) archive->finish(); // report errors writing the index
+    return rc;
+  } catch(const posix_error& e) {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return 3;
+  } catch(const std::runtime_error& e) {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return 3;
+  }
 }
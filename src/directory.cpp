@@ -9,6 +9,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <arpa/inet.h> // for 
 #endif
@@ -120,6 +121,31 @@ std::vector<std::string> directory_entries(std::string path)
   return entries; // rely on copy ellision / move
 } // directory_entries
 
+#ifdef WINDOWS
+bool exists(const std::string& path)
+{
+  return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+bool is_directory(const std::string& path)
+{
+  DWORD attr = GetFileAttributesA(path.c_str());
+  return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+}
+#else
+bool exists(const std::string& path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+bool is_directory(const std::string& path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+#endif // WINDOWS
+
 } // namespace vscharf
 
 
@@ -179,6 +205,16 @@ int main()
     }
   }
 
+  {
+    // assumes the test is called in the project root directory
+    assert(vscharf::exists("test_data"));
+    assert(vscharf::is_directory("test_data"));
+    assert(vscharf::exists("test_data/sound.wav"));
+    assert(!vscharf::is_directory("test_data/sound.wav"));
+    assert(!vscharf::exists("non_existent_dir"));
+    assert(!vscharf::is_directory("non_existent_dir"));
+  }
+
   {
     // assumes the test is called in the project root directory
     try {
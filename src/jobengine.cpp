@@ -0,0 +1,736 @@
+#include "jobengine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <utility>
+
+#include "archive.h"
+#include "directory.h" // posix_error
+#include "journal.h"
+#include "mp3encoder.h"
+#include "wavdecoder.h"
+
+#include <cerrno>
+
+#ifdef WINDOWS
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace vscharf {
+
+// ======== helper classes ========
+namespace {
+
+// read-only streambuf over a string, avoids the copy of an istringstream
+class memory_buf : public std::streambuf {
+public:
+  memory_buf(const std::string& s) {
+    char* p = const_cast<char*>(s.data()); // get area is never written
+    setg(p, p, p + s.size());
+  }
+};
+
+// streambuf appending to a string, avoids the copy of ostringstream::str
+class string_sink : public std::streambuf {
+public:
+  string_sink(std::string& s) : s_(s) {}
+protected:
+  int_type overflow(int_type c) override {
+    if(c != traits_type::eof()) s_ += traits_type::to_char_type(c);
+    return traits_type::not_eof(c);
+  }
+  std::streamsize xsputn(const char* p, std::streamsize n) override {
+    s_.append(p, n);
+    return n;
+  }
+private:
+  std::string& s_;
+};
+
+// Name of the temporary file an output is written to before it is
+// renamed to path. Unique per write, as several writers may write the
+// same output (a file submitted twice) at the same time.
+std::string temp_name(const std::string& path)
+{
+  static std::atomic<unsigned long> counter(0);
+#ifdef WINDOWS
+  const unsigned long pid = GetCurrentProcessId();
+#else
+  const unsigned long pid = getpid();
+#endif
+  return path + "." + std::to_string(pid) + "-" + std::to_string(++counter) + ".part";
+}
+
+#ifdef WINDOWS
+// no readahead hints available, the file is simply read on load()
+class prefetched_file {
+public:
+  prefetched_file(const std::string& path) : path_(path) {}
+  void load(std::string& data) {
+    std::ifstream in(path_, std::ios::binary);
+    if(!in) throw posix_error(errno);
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+private:
+  std::string path_;
+};
+
+void write_file(const std::string& path, const std::string& data)
+{
+  const std::string tmp = temp_name(path);
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    if(!out.write(data.data(), data.size())) throw posix_error(errno);
+  }
+  std::remove(path.c_str()); // rename doesn't replace on Windows
+  if(std::rename(tmp.c_str(), path.c_str())) throw posix_error(errno);
+}
+#else
+// An open file for which readahead of the whole file has been
+// requested. The kernel reads it asynchronously until load() is
+// called.
+class prefetched_file {
+public:
+  prefetched_file(const std::string& path) : fd_(open(path.c_str(), O_RDONLY)) {
+    if(fd_ < 0) throw posix_error(errno);
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_WILLNEED); // only a hint, ignore errors
+#endif
+  }
+  prefetched_file(prefetched_file&& other) noexcept : fd_(other.fd_) { other.fd_ = -1; }
+  prefetched_file(const prefetched_file&) = delete;
+  prefetched_file& operator=(const prefetched_file&) = delete;
+  ~prefetched_file() { if(fd_ >= 0) close(fd_); }
+
+  void load(std::string& data) {
+    struct stat st;
+    if(fstat(fd_, &st)) throw posix_error(errno);
+    data.resize(st.st_size);
+    std::size_t pos = 0;
+    while(pos < data.size()) {
+      ssize_t n = read(fd_, &data[pos], data.size() - pos);
+      if(n < 0 && errno == EINTR) continue;
+      if(n < 0) throw posix_error(errno);
+      if(n == 0) break; // file shrunk
+      pos += n;
+    }
+    data.resize(pos);
+  }
+private:
+  int fd_;
+};
+
+// Writes data to a temporary file next to path and renames it when
+// complete.
+void write_file(const std::string& path, const std::string& data)
+{
+  const std::string tmp = temp_name(path);
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if(fd < 0) throw posix_error(errno);
+  std::size_t pos = 0;
+  while(pos < data.size()) {
+    ssize_t n = write(fd, data.data() + pos, data.size() - pos);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) {
+      int err = errno;
+      close(fd);
+      unlink(tmp.c_str());
+      throw posix_error(err);
+    }
+    pos += n;
+  }
+  if(close(fd)) throw posix_error(errno);
+  if(rename(tmp.c_str(), path.c_str())) throw posix_error(errno);
+}
+#endif // WINDOWS
+
+} // anonymous namespace
+
+// ======== JobEngine ========
+namespace {
+JobEngine::Options sanitized(JobEngine::Options options)
+{
+  if(!options.encoders) options.encoders = 1;
+  if(!options.io_depth) options.io_depth = 1;
+  if(!options.io_threads) options.io_threads = 1;
+  if(!options.scale_interval_ms) options.scale_interval_ms = 1;
+  if(!options.max_encoders) {
+    // no autoscaling
+    options.min_encoders = options.max_encoders = options.encoders;
+  }
+  options.min_encoders = std::max(1u, std::min(options.min_encoders, options.max_encoders));
+  options.encoders = std::max(options.min_encoders, std::min(options.encoders, options.max_encoders));
+  return options;
+}
+
+void sleep_ms(unsigned ms)
+{
+#ifdef WINDOWS
+  Sleep(ms);
+#else
+  timespec t = { static_cast<time_t>(ms / 1000), static_cast<long>(ms % 1000) * 1000000L };
+  while(nanosleep(&t, &t) && errno == EINTR) {}
+#endif
+}
+} // anonymous namespace
+
+// The loaded/encoded queues hold at most two jobs per encoder, which
+// bounds the memory used by file contents independent of io_depth:
+// two files per encoder, or two whole albums per encoder for gapless
+// jobs, which keep all their tracks in memory.
+JobEngine::JobEngine(const Options& options)
+  : options_(sanitized(options))
+  , loaded_(2 * options_.max_encoders)
+  , encoded_(2 * options_.max_encoders)
+  , next_encoder_index_(0)
+  , active_encoders_(options_.encoders)
+  , autoscale_(options_.min_encoders < options_.max_encoders)
+  , stop_scaling_(false)
+  , audio_ms_(0)
+  , submitted_count_(0)
+  , succeeded_(0)
+  , failed_(0)
+  , errors_lock_(errors_)
+{
+  // do the work on (joinable) threads, shut down the threads already
+  // running before reporting a failure
+  try {
+    start_threads(readers_, options_.io_threads, read_loop);
+    start_threads(encoders_, options_.max_encoders, encode_loop);
+    start_threads(writers_, options_.io_threads, write_loop);
+    if(autoscale_) {
+      scoped_pthread_attr attr;
+      pthread_attr_setdetachstate(attr.get(), PTHREAD_CREATE_JOINABLE);
+      const int rc = pthread_create(&scaler_, attr.get(), scale_loop, this);
+      if(rc) {
+	autoscale_ = false;
+	throw posix_error(rc);
+      }
+    }
+  } catch(const posix_error&) {
+    finish();
+    throw;
+  }
+}
+
+void JobEngine::start_threads(std::vector<pthread_t>& threads, unsigned n, void* (*loop)(void*))
+{
+  scoped_pthread_attr attr;
+  pthread_attr_setdetachstate(attr.get(), PTHREAD_CREATE_JOINABLE);
+  for(unsigned i = 0; i < n; ++i) {
+    pthread_t t;
+    const int rc = pthread_create(&t, attr.get(), loop, this);
+    if(rc) throw posix_error(rc);
+    threads.push_back(t);
+  }
+}
+
+JobEngine::~JobEngine()
+{
+  finish();
+}
+
+namespace {
+JobEngine::Track make_track(std::string infile)
+{
+  JobEngine::Track track;
+  track.outfile = infile;
+  track.outfile.replace(track.outfile.size() - 3, 3, "mp3");
+  track.infile = std::move(infile);
+  return track;
+}
+} // anonymous namespace
+
+void JobEngine::submit(std::string infile)
+{
+  Job job;
+  job.tracks.push_back(make_track(std::move(infile)));
+  job.gapless = false;
+  ++submitted_count_;
+  submitted_.push(std::move(job));
+}
+
+void JobEngine::submit_album(std::vector<std::string> infiles)
+{
+  if(infiles.empty()) return;
+  Job job;
+  for(auto& f : infiles) job.tracks.push_back(make_track(std::move(f)));
+  job.gapless = true;
+  submitted_count_ += job.tracks.size();
+  submitted_.push(std::move(job));
+}
+
+void JobEngine::finish()
+{
+  if(finished_) return;
+  finished_ = true;
+  // every stage ends once the stage before has ended and its queue is
+  // drained; ignore error codes, the threads are known to be joinable
+  submitted_.close();
+  for(auto& t : readers_) pthread_join(t, nullptr);
+  loaded_.close();
+  if(autoscale_) {
+    stop_scaling_ = true;
+    pthread_join(scaler_, nullptr);
+  }
+  active_encoders_.set(encoders_.size()); // parked encoders have to see the end, too
+  for(auto& t : encoders_) pthread_join(t, nullptr);
+  encoded_.close();
+  for(auto& t : writers_) pthread_join(t, nullptr);
+  if(options_.journal) options_.journal->flush();
+}
+
+std::vector<std::string> JobEngine::take_errors()
+{
+  std::vector<std::string> errors;
+  auto lock = errors_lock_.acquire();
+  errors.swap(lock.get());
+  return errors;
+}
+
+void JobEngine::fail(const std::string& infile, const char* what, std::size_t nfiles /* = 1 */)
+{
+  failed_ += nfiles;
+  auto lock = errors_lock_.acquire();
+  lock.get().push_back(infile + ": " + what);
+}
+
+namespace {
+// Probes the header of the loaded track i of job and sets its
+// duration, so broken files never occupy an encoder.
+void check_format(JobEngine::Job& job, std::size_t i)
+{
+  auto& track = job.tracks[i];
+  const WavInfo info = probe_wav(track.data.data(), track.data.size());
+  if(job.gapless && i) {
+    const auto& data = job.tracks[0].data; // probing is cheap enough to repeat
+    const auto first = probe_wav(data.data(), data.size()).header;
+    if(info.header.channels != first.channels || info.header.samplesPerSec != first.samplesPerSec) {
+      throw decoder_error("Gapless tracks must have the same channels and sample rate!");
+    }
+  }
+  track.duration_ms = info.duration_ms;
+}
+} // anonymous namespace
+
+// Opens the files of submitted jobs ahead of time, at most this
+// reader's share of io_depth files (not jobs: an album opens all its
+// tracks) unless a single job has more, and hands them to the
+// encoders. Files that aren't valid WAV files fail here.
+void* JobEngine::read_loop(void* self)
+{
+  auto& engine = *static_cast<JobEngine*>(self);
+  const std::size_t depth = std::max(1u, engine.options_.io_depth / engine.options_.io_threads);
+  std::deque<std::pair<Job, std::vector<prefetched_file>>> window;
+  std::size_t open_files = 0; // in window
+  Job next;
+  bool has_next = false; // next is popped but doesn't fit into window yet
+  while(1) {
+    if(!has_next) has_next = window.empty() ? engine.submitted_.pop(next) : engine.submitted_.try_pop(next);
+    if(has_next && (window.empty() || open_files + next.tracks.size() <= depth)) {
+      has_next = false;
+      std::vector<prefetched_file> files;
+      for(const auto& track : next.tracks) {
+	try {
+	  files.emplace_back(track.infile);
+	} catch(const std::exception& e) {
+	  engine.fail(track.infile, e.what(), next.tracks.size());
+	  break;
+	}
+      }
+      if(files.size() == next.tracks.size()) {
+	open_files += files.size();
+	window.emplace_back(std::move(next), std::move(files));
+      }
+      next = Job();
+      continue;
+    }
+    if(window.empty()) break; // nothing submitted anymore
+
+    auto& front = window.front();
+    auto& tracks = front.first.tracks;
+    std::size_t i = 0;
+    try {
+      for(; i < tracks.size(); ++i) {
+	if(engine.options_.journal) engine.options_.journal->started(tracks[i].infile);
+	front.second[i].load(tracks[i].data);
+	check_format(front.first, i);
+      }
+      engine.loaded_.push(std::move(front.first));
+    } catch(const std::exception& e) {
+      engine.fail(tracks[i].infile, e.what(), tracks.size());
+    }
+    open_files -= front.second.size();
+    window.pop_front();
+  }
+  return nullptr;
+}
+
+// Encodes all tracks of job in memory, replacing their data by the
+// mp3. current is the index of the track being encoded.
+void JobEngine::encode_job(Job& job, std::size_t& current)
+{
+  Mp3Encoder encoder(options_.quality);
+  for(std::size_t i = 0; i < job.tracks.size(); ++i) {
+    current = i;
+    auto& track = job.tracks[i];
+    std::string mp3;
+    {
+      memory_buf inbuf(track.data);
+      std::istream in(&inbuf);
+      string_sink outbuf(mp3);
+      std::ostream out(&outbuf);
+
+      WavDecoder wav(in);
+      if(job.gapless) {
+	const auto tag = encoder.encode_gapless(wav, out, i + 1 == job.tracks.size());
+	if(tag.size() <= mp3.size()) mp3.replace(0, tag.size(), tag); // placeholder frame
+      } else {
+	encoder.encode(wav, out);
+      }
+    }
+    track.data = std::move(mp3);
+    audio_ms_ += track.duration_ms; // probed by the reader, counted once encoded
+  }
+}
+
+// Encodes loaded jobs while the encoder is active.
+void* JobEngine::encode_loop(void* self)
+{
+  auto& engine = *static_cast<JobEngine*>(self);
+  const unsigned index = engine.next_encoder_index_++;
+  Job job;
+  while(1) {
+    engine.active_encoders_.wait(index); // parked while index >= active encoders
+    if(!engine.loaded_.pop(job)) break;
+    std::size_t current = 0;
+    try {
+      engine.encode_job(job, current);
+      if(engine.options_.archive) engine.store(job);
+      else engine.encoded_.push(std::move(job));
+    } catch(const std::exception& e) {
+      engine.fail(job.tracks[current].infile, e.what(), job.tracks.size());
+    }
+  }
+  return nullptr;
+}
+
+// Appends the tracks of an encoded job to the archive.
+void JobEngine::store(Job& job)
+{
+  for(const auto& track : job.tracks) {
+    try {
+      options_.archive->append(track.outfile, track.data, track.duration_ms);
+      ++succeeded_;
+    } catch(const std::exception& e) {
+      fail(track.infile, e.what());
+    }
+  }
+}
+
+// Hill climbing on the audio throughput: every scale_interval_ms the
+// number of active encoders is moved by one in the current direction;
+// the direction is reversed if the throughput dropped compared to the
+// previous period. Periods without any work are ignored.
+void* JobEngine::scale_loop(void* self)
+{
+  auto& engine = *static_cast<JobEngine*>(self);
+  const Options& o = engine.options_;
+  const double tolerance = 0.03; // ignore measurement noise
+  double last_rate = -1;
+  int direction = 1;
+  uint64_t last_audio_ms = engine.audio_ms_;
+
+  while(!engine.stop_scaling_) {
+    for(unsigned slept = 0; slept < o.scale_interval_ms && !engine.stop_scaling_; slept += 100) {
+      sleep_ms(std::min(100u, o.scale_interval_ms - slept));
+    }
+    const uint64_t audio_ms = engine.audio_ms_;
+    const uint64_t encoded_ms = audio_ms - last_audio_ms;
+    last_audio_ms = audio_ms;
+    if(!encoded_ms && !engine.pending()) continue; // idle
+    const double rate = double(encoded_ms) / o.scale_interval_ms;
+
+    if(last_rate >= 0 && rate < last_rate * (1 - tolerance)) direction = -direction;
+    last_rate = rate;
+
+    const unsigned current = engine.active_encoders_.get();
+    unsigned next = current;
+    if(direction > 0 && current < o.max_encoders) ++next;
+    else if(direction < 0 && current > o.min_encoders) --next;
+    else direction = -direction; // at a bound, probe the other way next time
+    if(next != current) engine.active_encoders_.set(next);
+  }
+  return nullptr;
+}
+
+// Writes encoded jobs to their output files.
+void* JobEngine::write_loop(void* self)
+{
+  auto& engine = *static_cast<JobEngine*>(self);
+  Job job;
+  while(engine.encoded_.pop(job)) {
+    for(const auto& track : job.tracks) {
+      try {
+	write_file(track.outfile, track.data);
+	if(engine.options_.journal) engine.options_.journal->finished(track.infile, track.outfile, track.data);
+	++engine.succeeded_;
+      } catch(const std::exception& e) {
+	engine.fail(track.infile, e.what());
+      }
+    }
+  }
+  return nullptr;
+}
+
+} // namespace vscharf
+
+#ifdef TEST_JOB
+// some basic unit testing, assumes the test is called in the project
+// root directory
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+int main()
+{
+  vscharf::JobEngine::Options options;
+  options.quality = 2;
+  options.encoders = 2;
+  options.io_depth = 2; // smaller than the number of jobs
+  {
+    vscharf::JobEngine engine(options);
+    engine.submit("test_data/sound.wav");
+    engine.submit("test_data/sound1.wav");
+    engine.submit("test_data/non_existent.wav");
+    engine.submit("test_data/sound2.wav");
+    engine.submit("test_data/.gitignore"); // rejected by the reader's probe
+    engine.finish();
+    assert(engine.succeeded() == 3);
+    assert(engine.failed() == 2);
+    assert(engine.pending() == 0);
+    auto errors = engine.take_errors();
+    std::sort(errors.begin(), errors.end()); // readers run in parallel
+    assert(errors.size() == 2);
+    assert(errors[0] == "test_data/.gitignore: No RIFF file");
+    assert(errors[1].find("test_data/non_existent.wav") == 0);
+    assert(engine.take_errors().empty());
+  }
+
+  // output has to be identical to encoding the file directly
+  for(const char* name : {"test_data/sound.wav", "test_data/sound1.wav", "test_data/sound2.wav"}) {
+    std::string outname(name);
+    outname.replace(outname.size() - 3, 3, "mp3");
+    std::ifstream produced(outname);
+    std::string actual((std::istreambuf_iterator<char>(produced)), std::istreambuf_iterator<char>());
+
+    std::ifstream wav_file(name);
+    std::ostringstream expected;
+    vscharf::WavDecoder w(wav_file);
+    vscharf::Mp3Encoder l(options.quality);
+    l.encode(w, expected);
+    assert(!actual.empty());
+    assert(actual == expected.str());
+  }
+
+  {
+    // an album produces one output per track, each starting with the
+    // lame tag frame
+    vscharf::JobEngine engine(options);
+    engine.submit_album({"test_data/sound.wav", "test_data/sound1.wav", "test_data/sound2.wav"});
+    engine.submit_album({"test_data/sound.wav", "test_data/non_existent.wav"});
+    engine.finish();
+    assert(engine.succeeded() == 3);
+    assert(engine.failed() == 2);
+    assert(engine.pending() == 0);
+    for(const char* name : {"test_data/sound.mp3", "test_data/sound1.mp3", "test_data/sound2.mp3"}) {
+      std::ifstream produced(name);
+      std::string head(64, 0);
+      produced.read(&head[0], head.size());
+      assert(head.find("Info") != std::string::npos || head.find("Xing") != std::string::npos);
+    }
+  }
+
+  {
+    // autoscaling stays within its bounds and loses no jobs
+    vscharf::JobEngine::Options scaled = options;
+    scaled.encoders = 1;
+    scaled.min_encoders = 1;
+    scaled.max_encoders = 3;
+    scaled.scale_interval_ms = 1;
+    vscharf::JobEngine engine(scaled);
+    assert(engine.encoders() == 1);
+    for(int i = 0; i < 200; ++i) {
+      engine.submit("test_data/sound.wav");
+      const unsigned n = engine.encoders();
+      assert(n >= 1 && n <= 3);
+    }
+    engine.finish();
+    assert(engine.succeeded() == 200);
+    assert(engine.audio_seconds() > 0);
+  }
+
+  {
+    // a collapsed range fixes the count, encoders doesn't override it
+    vscharf::JobEngine::Options fixed = options;
+    fixed.encoders = 4;
+    fixed.min_encoders = fixed.max_encoders = 2;
+    vscharf::JobEngine engine(fixed);
+    assert(engine.encoders() == 2);
+    engine.finish();
+  }
+
+  {
+    // with an archive no mp3 files are written
+    for(const char* name : {"test_data/sound.mp3", "test_data/sound1.mp3"}) std::remove(name);
+    const std::string archive_path = "test_data/job_test.mp3a";
+    {
+      vscharf::ArchiveWriter archive(archive_path);
+      vscharf::JobEngine::Options archived = options;
+      archived.archive = &archive;
+      vscharf::JobEngine engine(archived);
+      engine.submit("test_data/sound.wav");
+      engine.submit("test_data/sound1.wav");
+      engine.finish();
+      assert(engine.succeeded() == 2);
+    }
+    assert(!vscharf::exists("test_data/sound.mp3"));
+
+    vscharf::ArchiveReader reader(archive_path);
+    vscharf::ArchiveReader::Clip clip;
+    assert(reader.size() == 2);
+    assert(reader.find("test_data/sound1.mp3", clip));
+    assert(clip.duration_ms == 750); // 33075 frames at 44100 Hz
+
+    std::ifstream wav_file("test_data/sound1.wav");
+    std::ostringstream expected;
+    vscharf::WavDecoder w(wav_file);
+    vscharf::Mp3Encoder l(options.quality);
+    l.encode(w, expected);
+    assert(std::string(clip.data, clip.size) == expected.str());
+    std::remove(archive_path.c_str());
+  }
+
+  std::cout << "Test finished successfully!" << std::endl;
+  return 0;
+}
+#endif // TEST_JOB
+
+#ifdef BENCH_JOB
+// files/s over many tiny clips for different numbers of encoders,
+// I/O depths and I/O threads. The inputs are dropped from the page
+// cache before every run (where the OS supports it), so opens and
+// reads hit the disk like in a real batch.
+//   job_bench [directory] [nfiles]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace {
+void put(std::string& s, uint32_t v, int bytes) {
+  for(int i = 0; i < bytes; ++i) s += static_cast<char>((v >> (8*i)) & 0xFF);
+}
+
+// 50 ms of 16-bit mono audio at 44.1 kHz
+std::string tiny_clip() {
+  const uint32_t frames = 2205;
+  std::string s("RIFF");
+  put(s, 36 + 2 * frames, 4);
+  s += "WAVEfmt ";
+  put(s, 16, 4);
+  put(s, 1, 2); // PCM
+  put(s, 1, 2);
+  put(s, 44100, 4);
+  put(s, 88200, 4);
+  put(s, 2, 2);
+  put(s, 16, 2);
+  s += "data";
+  put(s, 2 * frames, 4);
+  for(uint32_t i = 0; i < frames; ++i) put(s, (i * 97) & 0x3FFF, 2);
+  return s;
+}
+
+void drop_cache(const std::vector<std::string>& files) {
+#if !defined(WINDOWS) && defined(POSIX_FADV_DONTNEED)
+  for(const auto& f : files) {
+    const int fd = open(f.c_str(), O_RDONLY);
+    if(fd < 0) continue;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+#else
+  (void)files;
+#endif
+}
+
+double run(const std::vector<std::string>& files, unsigned encoders, unsigned io_depth, unsigned io_threads) {
+  drop_cache(files);
+  vscharf::JobEngine::Options options;
+  options.quality = 2;
+  options.encoders = encoders;
+  options.io_depth = io_depth;
+  options.io_threads = io_threads;
+  const auto start = std::chrono::steady_clock::now();
+  vscharf::JobEngine engine(options);
+  for(const auto& f : files) engine.submit(f);
+  engine.finish();
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  if(engine.succeeded() != files.size()) std::cerr << "FAILED FILES: " << engine.failed() << std::endl;
+  return files.size() / d.count();
+}
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  std::string dir = argc > 1 ? argv[1] : "";
+  const std::size_t nfiles = argc > 2 ? std::atoi(argv[2]) : 2000;
+  if(dir.empty()) {
+    char tmpl[] = "/tmp/job_bench_XXXXXX";
+    dir = mkdtemp(tmpl);
+  }
+
+  const std::string clip = tiny_clip();
+  std::vector<std::string> files;
+  for(std::size_t i = 0; i < nfiles; ++i) {
+    files.push_back(dir + "/clip" + std::to_string(i) + ".wav");
+    std::ofstream(files.back(), std::ios::binary) << clip;
+  }
+
+  std::cout << nfiles << " clips of 50 ms in " << dir << std::endl;
+  for(unsigned io_threads : {1u, 4u, 16u}) {
+    for(unsigned io_depth : {1u, 256u}) {
+      for(unsigned encoders : {1u, 4u}) {
+	std::cout << "-j " << encoders << " -d " << io_depth << " -t " << io_threads << ": "
+		  << run(files, encoders, io_depth, io_threads) << " files/s" << std::endl;
+      }
+    }
+  }
+
+  for(auto f : files) {
+    std::remove(f.c_str());
+    std::remove(f.replace(f.size() - 3, 3, "mp3").c_str());
+  }
+  if(argc <= 1) rmdir(dir.c_str());
+  return 0;
+}
+#endif // BENCH_JOB
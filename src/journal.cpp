@@ -0,0 +1,313 @@
+#include "journal.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "directory.h" // posix_error
+
+#ifdef WINDOWS
+#include <errno.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace vscharf {
+
+// ======== helper functions ========
+namespace {
+
+struct crc_table {
+  uint32_t t[256];
+  crc_table() {
+    for(uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for(int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+  }
+};
+
+// Continues the (pre- and post-inverted) CRC-32 c over n bytes at p.
+uint32_t crc32_update(uint32_t c, const char* p, std::size_t n)
+{
+  static const crc_table table;
+  c ^= 0xFFFFFFFFu;
+  for(std::size_t i = 0; i < n; ++i) c = table.t[(c ^ static_cast<unsigned char>(p[i])) & 0xFF] ^ (c >> 8);
+  return c ^ 0xFFFFFFFFu;
+}
+
+// Size and modification time (ns since the epoch) of path.
+bool file_stat(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+  struct stat st;
+  if(stat(path.c_str(), &st)) return false;
+  size = st.st_size;
+#ifdef __linux__
+  mtime = st.st_mtim.tv_sec * INT64_C(1000000000) + st.st_mtim.tv_nsec;
+#else
+  mtime = st.st_mtime * INT64_C(1000000000);
+#endif
+  return true;
+}
+
+bool file_crc32(const std::string& path, uint32_t& crc)
+{
+  std::ifstream in(path, std::ios::binary);
+  if(!in) return false;
+  std::vector<char> buf(64 * 1024);
+  crc = 0;
+  while(in.read(buf.data(), buf.size()) || in.gcount()) crc = crc32_update(crc, buf.data(), in.gcount());
+  return in.eof();
+}
+
+std::string directory_of(const std::string& path)
+{
+  const auto slash = path.rfind('/');
+  if(slash == std::string::npos) return ".";
+  return slash ? path.substr(0, slash) : "/";
+}
+
+#ifdef WINDOWS
+int open_append(const std::string& path) { return _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE); }
+int write_some(int fd, const char* p, std::size_t n) { return _write(fd, p, n); }
+int sync_fd(int fd) { return _commit(fd); }
+void sync_outputs(const std::set<std::string>&) {} // no syncfs, the outputs are flushed by the OS
+void close_fd(int fd) { _close(fd); }
+#else
+int open_append(const std::string& path) { return open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644); }
+ssize_t write_some(int fd, const char* p, std::size_t n) { return write(fd, p, n); }
+int sync_fd(int fd) { return fdatasync(fd); }
+// Makes the outputs in dirs durable with one syncfs per filesystem
+// instead of one fsync per output. The journal may live on another
+// filesystem, it is synced separately.
+void sync_outputs(const std::set<std::string>& dirs)
+{
+#ifdef __linux__
+  std::set<dev_t> synced;
+  for(const auto& dir : dirs) {
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) throw posix_error(errno);
+    struct stat st;
+    int rc = fstat(fd, &st);
+    if(!rc && synced.insert(st.st_dev).second) rc = syncfs(fd);
+    const int err = errno;
+    close(fd);
+    if(rc) throw posix_error(err);
+  }
+#else
+  if(!dirs.empty()) sync();
+#endif
+}
+void close_fd(int fd) { close(fd); }
+#endif // WINDOWS
+
+} // anonymous namespace
+
+uint32_t crc32(const std::string& data)
+{
+  return crc32_update(0, data.data(), data.size());
+}
+
+// ======== Journal ========
+Journal::Journal(const std::string& path, std::size_t batch_size /* = 64 */)
+  : batch_size_(batch_size ? batch_size : 1)
+  , fd_(-1)
+  , last_flush_(std::chrono::steady_clock::now())
+  , pending_lock_(pending_)
+{
+  replay(path);
+  fd_ = open_append(path);
+  if(fd_ < 0) throw posix_error(errno);
+}
+
+Journal::~Journal()
+{
+  try {
+    flush();
+  } catch(const posix_error&) {
+    // destructor must never fail, the records are simply lost
+  }
+  close_fd(fd_);
+}
+
+// Reads the completion records of previous runs. Start records are
+// only informational: a started but not completed job is redone.
+void Journal::replay(const std::string& path)
+{
+  std::ifstream in(path, std::ios::binary);
+  std::string line;
+  while(std::getline(in, line)) {
+    if(in.eof()) { // no trailing newline: torn record, terminate it
+      pending_ = "\n";
+      break;
+    }
+    if(line.size() < 2 || line[0] != 'D' || line[1] != '\t') continue;
+
+    const auto size_pos = line.find('\t', 2);
+    const auto crc_pos = size_pos == std::string::npos ? size_pos : line.find('\t', size_pos + 1);
+    if(crc_pos == std::string::npos) continue;
+
+    Entry e;
+    char* end = nullptr;
+    e.size = std::strtoull(line.c_str() + size_pos + 1, &end, 10);
+    if(*end != '\t') continue;
+    e.crc = std::strtoul(line.c_str() + crc_pos + 1, &end, 16);
+    e.mtime = 0;
+    if(*end == '\t') e.mtime = std::strtoll(end + 1, &end, 10);
+    if(*end) continue;
+    replayed_[line.substr(2, size_pos - 2)] = e;
+  }
+}
+
+bool Journal::completed(const std::string& infile, const std::string& outfile) const
+{
+  const auto e = replayed_.find(infile);
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  if(e == replayed_.end() || !file_stat(outfile, size, mtime) || size != e->second.size) return false;
+  if(e->second.mtime && mtime == e->second.mtime) return true;
+
+  // touched, copied or recorded by an older version: compare contents
+  uint32_t crc = 0;
+  return file_crc32(outfile, crc) && crc == e->second.crc;
+}
+
+void Journal::started(const std::string& infile)
+{
+  auto lock = pending_lock_.acquire();
+  lock.get() += "S\t" + infile + '\n';
+}
+
+void Journal::finished(const std::string& infile, const std::string& outfile, const std::string& data)
+{
+  char crc[9];
+  std::snprintf(crc, sizeof(crc), "%08x", static_cast<unsigned>(crc32(data)));
+  std::ostringstream record;
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  if(!file_stat(outfile, size, mtime)) mtime = 0; // always verified by CRC
+  record << "D\t" << infile << '\t' << data.size() << '\t' << crc << '\t' << mtime << '\n';
+
+  auto lock = pending_lock_.acquire();
+  lock.get() += record.str();
+  pending_dirs_.insert(directory_of(outfile));
+  if(++pending_completions_ >= batch_size_ ||
+     std::chrono::steady_clock::now() - last_flush_ > std::chrono::seconds(1)) {
+    flush_locked(lock.get());
+  }
+}
+
+void Journal::flush()
+{
+  auto lock = pending_lock_.acquire();
+  flush_locked(lock.get());
+}
+
+// Expects pending_lock_ to be held.
+void Journal::flush_locked(std::string& pending)
+{
+  if(pending.empty()) return;
+  sync_outputs(pending_dirs_);
+  pending_dirs_.clear();
+
+  std::size_t pos = 0;
+  while(pos < pending.size()) {
+    const auto n = write_some(fd_, pending.data() + pos, pending.size() - pos);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw posix_error(errno);
+    pos += n;
+  }
+  if(sync_fd(fd_)) throw posix_error(errno);
+  pending.clear();
+  pending_completions_ = 0;
+  last_flush_ = std::chrono::steady_clock::now();
+}
+
+} // namespace vscharf
+
+#ifdef TEST_JOURNAL
+// some basic unit testing
+#include <cassert>
+#include <iostream>
+int main()
+{
+  assert(vscharf::crc32("") == 0);
+  assert(vscharf::crc32("123456789") == 0xCBF43926u);
+
+  char tmpl[] = "/tmp/journal_test_XXXXXX";
+  const std::string dir = mkdtemp(tmpl);
+  const std::string path = dir + "/journal";
+  const std::string out_a = dir + "/a.mp3";
+  const std::string out_b = dir + "/b.mp3";
+
+  {
+    vscharf::Journal j(path, 2);
+    assert(!j.completed("a.wav", out_a));
+    j.started("a.wav");
+    j.started("b.wav");
+    std::ofstream(out_a) << "0123456789";
+    j.finished("a.wav", out_a, "0123456789");
+    // b is started but never finished
+  }
+
+  {
+    // torn last record
+    std::ofstream(path, std::ios::app) << "D\tb.wav\t3";
+    std::ofstream(out_b) << "abc";
+
+    vscharf::Journal j(path);
+    assert(j.completed("a.wav", out_a));
+    assert(!j.completed("b.wav", out_b));
+    assert(!j.completed("c.wav", out_a));
+
+    // the size and mtime are trusted without reading the output
+    struct stat st;
+    assert(!stat(out_a.c_str(), &st));
+    std::ofstream(out_a) << "0123456780";
+    const timespec times[2] = { st.st_atim, st.st_mtim };
+    assert(!utimensat(AT_FDCWD, out_a.c_str(), times, 0));
+    assert(j.completed("a.wav", out_a));
+
+    // a changed output (other mtime) is compared by CRC
+    const timespec touched[2] = { { 1, 0 }, { 1, 0 } };
+    assert(!utimensat(AT_FDCWD, out_a.c_str(), touched, 0));
+    assert(!j.completed("a.wav", out_a));
+    std::ofstream(out_a) << "0123456789";
+    assert(!utimensat(AT_FDCWD, out_a.c_str(), touched, 0));
+    assert(j.completed("a.wav", out_a));
+
+    // a partial output is not complete
+    std::ofstream(out_a) << "01234";
+    assert(!j.completed("a.wav", out_a));
+
+    // records after the torn one are readable
+    j.finished("b.wav", out_b, "abc");
+  }
+
+  {
+    // records of older versions without mtime are verified by CRC
+    std::ofstream(path, std::ios::app) << "D\tc.wav\t3\t352441c2\n";
+    vscharf::Journal j(path);
+    assert(j.completed("b.wav", out_b));
+    assert(j.completed("c.wav", out_b));
+    std::ofstream(out_b) << "abd";
+    assert(!j.completed("c.wav", out_b));
+  }
+
+  std::remove(path.c_str());
+  std::remove(out_a.c_str());
+  std::remove(out_b.c_str());
+  rmdir(dir.c_str());
+  std::cout << "Test finished successfully!" << std::endl;
+  return 0;
+}
+#endif // TEST_JOURNAL
@@ -18,14 +18,33 @@ Mp3Encoder::~Mp3Encoder()
   lame_close(gfp_);
 }
 
-// Encode the data from in to an ostream out taking nsamples at
-// once. If nsamples is zero it will be chosen such that 4k bytes will
-// be processed at once.
-void Mp3Encoder::encode(WavDecoder& in, std::ostream& out, uint32_t nsamples /* = 0 */)
+namespace {
+// Hands one block of interleaved 16-bit PCM to lame. With a
+// compile-time channel count the branch is folded away.
+inline int encode_pcm(lame_global_flags* gfp, const int16_t* pcm, uint32_t nvalues,
+		      uint16_t channels, Mp3Encoder::char_buffer& out)
 {
-  if(!out) throw decoder_error("Invalid output stream!");
+  if(channels > 1) {
+    return lame_encode_buffer_interleaved(gfp,
+					  const_cast<int16_t*>(pcm),
+					  nvalues / channels,
+					  reinterpret_cast<unsigned char*>(&out[0]),
+					  out.size());
+  } else {
+    return lame_encode_buffer(gfp,
+			      const_cast<int16_t*>(pcm),
+			      nullptr,
+			      nvalues,
+			      reinterpret_cast<unsigned char*>(&out[0]),
+			      out.size());
+  }
+}
+} // anonymous namespace
 
-  // initialize lame
+// Initializes lame for the format of in and sizes the output
+// buffer. Returns the (auto-determined) number of samples per block.
+uint32_t Mp3Encoder::init_params(const WavDecoder& in, uint32_t nsamples)
+{
   lame_set_num_channels(gfp_, in.get_header().channels);
   lame_set_in_samplerate(gfp_, in.get_header().samplesPerSec);
   lame_set_quality(gfp_, quality_);
@@ -34,38 +53,114 @@ void Mp3Encoder::encode(WavDecoder& in, std::ostream& out, uint32_t nsamples /*
   // auto-determine sample size
   if(!nsamples) nsamples = 4096 / in.get_header().bytesPerSample;
   buf_.resize(1.25 * nsamples + 7200); // worst-case estimate from lame/API
+  return nsamples;
+}
 
-  // the actual encoding
+// The encoding loop for a fixed sample layout.
+template<typename Format>
+void Mp3Encoder::encode_blocks(WavDecoder& in, std::ostream& out, uint32_t nsamples)
+{
   while(in.has_next()) {
-    const auto& inbuf = in.read_samples(nsamples);
-
-    int n;
-    if(in.get_header().channels > 1) {
-      n = lame_encode_buffer_interleaved(gfp_,
-					 const_cast<int16_t*>(&inbuf[0]),
-					 inbuf.size() / in.get_header().channels,
-					 reinterpret_cast<unsigned char*>(&buf_[0]),
-					 buf_.size());
-    } else {
-      n = lame_encode_buffer(gfp_,
-			     const_cast<int16_t*>(&inbuf[0]),
-			     nullptr,
-			     inbuf.size(),
-			     reinterpret_cast<unsigned char*>(&buf_[0]),
-			     buf_.size());
-    }
+    const auto& inbuf = in.read_samples<Format>(nsamples);
+    int n = encode_pcm(gfp_, inbuf.data(), inbuf.size(), Format::channels, buf_);
+    if(n < 0) throw decoder_error("lame_encode_buffer returned error!");
+    if(!out.write(buf_.data(), n)) throw decoder_error("Writing to output failed!");
+  }
+}
 
+// The generic encoding loop, layout is looked up for every block.
+template<>
+void Mp3Encoder::encode_blocks<void>(WavDecoder& in, std::ostream& out, uint32_t nsamples)
+{
+  while(in.has_next()) {
+    const auto& inbuf = in.read_samples(nsamples);
+    int n = encode_pcm(gfp_, inbuf.data(), inbuf.size(), in.get_header().channels, buf_);
     if(n < 0) throw decoder_error("lame_encode_buffer returned error!");
     if(!out.write(buf_.data(), n)) throw decoder_error("Writing to output failed!");
   }
+}
+
+// Encode the data from in to an ostream out taking nsamples at
+// once. If nsamples is zero it will be chosen such that 4k bytes will
+// be processed at once. The sample layout is dispatched once here;
+// uncommon layouts fall back to the generic loop.
+void Mp3Encoder::encode(WavDecoder& in, std::ostream& out, uint32_t nsamples /* = 0 */)
+{
+  if(!out) throw decoder_error("Invalid output stream!");
+  nsamples = init_params(in, nsamples);
+  encode_layout(in, out, nsamples);
+  flush(out);
+}
+
+// Encode a track of an album without resetting lame in between, so
+// no priming/padding is inserted at track boundaries. Follows the
+// --nogap handling of the lame frontend: flush_nogap after every but
+// the last track, fetch the tag frame and start a new bitstream.
+Mp3Encoder::char_buffer Mp3Encoder::encode_gapless(WavDecoder& in, std::ostream& out, bool last,
+						   uint32_t nsamples /* = 0 */)
+{
+  if(!out) throw decoder_error("Invalid output stream!");
+  const auto& header = in.get_header();
+  if(!gapless_tracks_) {
+    lame_set_bWriteVbrTag(gfp_, 1);
+    gapless_nsamples_ = init_params(in, nsamples);
+    gapless_channels_ = header.channels;
+    gapless_samplerate_ = header.samplesPerSec;
+  } else if(header.channels != gapless_channels_ || header.samplesPerSec != gapless_samplerate_) {
+    throw lame_error("Gapless tracks must have the same channels and sample rate!");
+  } else if(lame_init_bitstream(gfp_) < 0) {
+    throw lame_error("lame_init_bitstream failed!");
+  }
+  ++gapless_tracks_;
+
+  buf_.resize(1.25 * gapless_nsamples_ + 7200); // shrunk by the last flush
+  encode_layout(in, out, gapless_nsamples_);
+  if(last) flush(out);
+  else flush_nogap(out);
+
+  char_buffer tag(buf_.size(), 0);
+  const auto n = lame_get_lametag_frame(gfp_, reinterpret_cast<unsigned char*>(&tag[0]), tag.size());
+  if(n > tag.size()) throw lame_error("lame tag frame too large!");
+  tag.resize(n);
+  return tag;
+}
 
-  // flush the rest
+// Dispatches to the encoding loop for the sample layout of in.
+void Mp3Encoder::encode_layout(WavDecoder& in, std::ostream& out, uint32_t nsamples)
+{
+  if(in.matches<PcmFormat<16, 2>>()) encode_blocks<PcmFormat<16, 2>>(in, out, nsamples);
+  else if(in.matches<PcmFormat<16, 1>>()) encode_blocks<PcmFormat<16, 1>>(in, out, nsamples);
+  else if(in.matches<PcmFormat<8, 2>>()) encode_blocks<PcmFormat<8, 2>>(in, out, nsamples);
+  else if(in.matches<PcmFormat<8, 1>>()) encode_blocks<PcmFormat<8, 1>>(in, out, nsamples);
+  else encode_blocks<void>(in, out, nsamples);
+}
+
+void Mp3Encoder::encode_generic(WavDecoder& in, std::ostream& out, uint32_t nsamples /* = 0 */)
+{
+  if(!out) throw decoder_error("Invalid output stream!");
+  nsamples = init_params(in, nsamples);
+  encode_blocks<void>(in, out, nsamples);
+  flush(out);
+}
+
+// flush the rest
+void Mp3Encoder::flush(std::ostream& out)
+{
   buf_.resize(7200);
   auto n = lame_encode_flush(gfp_, reinterpret_cast<unsigned char*>(&buf_[0]), buf_.size());
   if(n < 0) throw decoder_error("lame_encode_flush returned error!");
   if(n > 0 && !out.write(buf_.data(), n)) throw decoder_error("Writing to output failed!");
 }
 
+// flush the rest of a track, keeping the encoder state for the next one
+void Mp3Encoder::flush_nogap(std::ostream& out)
+{
+  buf_.resize(7200);
+  auto n = lame_encode_flush_nogap(gfp_, reinterpret_cast<unsigned char*>(&buf_[0]), buf_.size());
+  if(n < 0) throw decoder_error("lame_encode_flush_nogap returned error!");
+  if(n > 0 && !out.write(buf_.data(), n)) throw decoder_error("Writing to output failed!");
+}
+
 #ifdef TEST_ENC
 #include <cassert>
 #include <fstream>
@@ -105,7 +200,100 @@ int main(int argc, char* argv[])
   output.read(&bytes[0], 4);
   assert((bytes == std::string{'\x0d', '\x5f', '\xed', '\x4a'}));
 
+  {
+    // the specialised and the generic loop produce identical output
+    std::ifstream generic_file(input);
+    std::stringstream generic_output;
+    WavDecoder w(generic_file);
+    Mp3Encoder l(2);
+    l.encode_generic(w, generic_output);
+    assert(generic_output.str() == output.str());
+  }
+
+  {
+    // an album of more than two tracks with large blocks: the output
+    // buffer must be big enough for every track, not just the first
+    const uint32_t nsamples = 65536;
+    Mp3Encoder l(2);
+    for(int track = 0; track < 4; ++track) {
+      std::ifstream album_file(input);
+      std::stringstream album_output;
+      WavDecoder w(album_file);
+      const auto tag = l.encode_gapless(w, album_output, track == 3, nsamples);
+      assert(!album_output.str().empty());
+      assert(!tag.empty());
+    }
+  }
+
   std::cout << "Test finished successfully!" << std::endl;
   return 0;
 }
 #endif // TEST_ENC
+
+#ifdef BENCH_ENC
+// compares encode (layout specialised once per file) with
+// encode_generic on synthetic in-memory WAV files
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+namespace {
+void put(std::string& s, uint32_t v, int bytes) {
+  for(int i = 0; i < bytes; ++i) s += static_cast<char>((v >> (8*i)) & 0xFF);
+}
+
+std::string make_wav(uint16_t bits, uint16_t channels, uint32_t rate, uint32_t frames) {
+  const uint32_t block_align = channels * bits / 8;
+  const uint32_t data_size = frames * block_align;
+  std::string s("RIFF");
+  put(s, 36 + data_size, 4);
+  s += "WAVEfmt ";
+  put(s, 16, 4);
+  put(s, 1, 2); // PCM
+  put(s, channels, 2);
+  put(s, rate, 4);
+  put(s, rate * block_align, 4);
+  put(s, block_align, 2);
+  put(s, bits, 2);
+  s += "data";
+  put(s, data_size, 4);
+  for(uint32_t i = 0; i < data_size; ++i) s += static_cast<char>(i * 31);
+  return s;
+}
+
+double run(const std::string& wav, bool specialised, std::string& mp3) {
+  auto start = std::chrono::steady_clock::now();
+  std::istringstream in(wav);
+  std::ostringstream out;
+  WavDecoder w(in);
+  Mp3Encoder l(5);
+  if(specialised) l.encode(w, out);
+  else l.encode_generic(w, out);
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  mp3 = out.str();
+  return d.count();
+}
+
+void compare(const char* name, uint16_t bits, uint16_t channels, uint32_t rate) {
+  const uint32_t frames = rate * 30; // 30 seconds of audio
+  const std::string wav = make_wav(bits, channels, rate, frames);
+  std::string mp3_generic, mp3_special;
+  double generic = run(wav, false, mp3_generic);
+  double special = run(wav, true, mp3_special);
+  const double audio = double(frames) / rate;
+  std::cout << name << " @ " << rate << " Hz: encode_generic " << audio / generic
+	    << " audio-s/s, encode " << audio / special
+	    << " audio-s/s (x" << generic / special << ")"
+	    << (mp3_generic == mp3_special ? "" : " OUTPUT MISMATCH")
+	    << std::endl;
+}
+} // anonymous namespace
+
+int main() {
+  compare("s16 mono  ", 16, 1, 44100);
+  compare("s16 stereo", 16, 2, 44100);
+  compare("u8 mono   ", 8, 1, 44100);
+  compare("u8 stereo ", 8, 2, 44100);
+  return 0;
+}
+#endif // BENCH_ENC
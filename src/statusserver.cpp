@@ -0,0 +1,108 @@
+#include "statusserver.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "directory.h" // posix_error
+
+#ifndef WINDOWS
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace vscharf {
+
+#ifndef WINDOWS
+StatusServer::StatusServer(const std::string& path, std::function<std::string()> report)
+  : path_(path)
+  , report_(std::move(report))
+  , fd_(socket(AF_UNIX, SOCK_STREAM, 0))
+  , stop_(false)
+{
+  if(fd_ < 0) throw posix_error(errno);
+
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path_.size() >= sizeof(addr.sun_path)) {
+    close(fd_);
+    throw posix_error(ENAMETOOLONG);
+  }
+  std::strcpy(addr.sun_path, path_.c_str());
+
+  // only remove a socket left over from a previous run, never a
+  // regular file given by mistake
+  struct stat st;
+  if(!lstat(path_.c_str(), &st)) {
+    if(!S_ISSOCK(st.st_mode)) {
+      close(fd_);
+      throw posix_error(EEXIST);
+    }
+    unlink(path_.c_str());
+  }
+  if(bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || listen(fd_, 16)) {
+    const int err = errno;
+    close(fd_);
+    throw posix_error(err);
+  }
+
+  const int rc = pthread_create(&thread_, nullptr, serve_loop, this);
+  if(rc) {
+    close(fd_);
+    unlink(path_.c_str());
+    throw posix_error(rc);
+  }
+}
+
+StatusServer::~StatusServer()
+{
+  stop_ = true;
+  pthread_join(thread_, nullptr);
+  close(fd_);
+  unlink(path_.c_str());
+}
+
+// Accepts clients until stop_ is set; polls so that the flag is
+// checked regularly.
+void* StatusServer::serve_loop(void* self)
+{
+  auto& server = *static_cast<StatusServer*>(self);
+  while(!server.stop_) {
+    pollfd p = { server.fd_, POLLIN, 0 };
+    if(poll(&p, 1, 200) <= 0) continue;
+
+    const int client = accept(server.fd_, nullptr, nullptr);
+    if(client < 0) continue;
+    try {
+      const std::string report = server.report_();
+      std::size_t pos = 0;
+      while(pos < report.size()) {
+	const ssize_t n = send(client, report.data() + pos, report.size() - pos, MSG_NOSIGNAL);
+	if(n <= 0) break; // client went away
+	pos += n;
+      }
+    } catch(const std::exception&) {
+      // a broken report must not stop the server
+    }
+    close(client);
+  }
+  return nullptr;
+}
+#else
+StatusServer::StatusServer(const std::string&, std::function<std::string()>)
+  : fd_(-1)
+  , stop_(true)
+{
+  throw std::runtime_error("Status sockets are not supported on Windows");
+}
+
+StatusServer::~StatusServer() {}
+void* StatusServer::serve_loop(void*) { return nullptr; }
+#endif // WINDOWS
+
+} // namespace vscharf
@@ -0,0 +1,233 @@
+#include "watcher.h"
+
+#include <stdexcept>
+
+#include "directory.h"
+
+#ifdef __linux__
+#include <climits> // NAME_MAX
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace vscharf {
+
+#ifdef __linux__
+namespace {
+const uint32_t FILE_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO;
+const uint32_t DIR_EVENTS = IN_CREATE | IN_MOVED_TO;
+
+bool is_dot_entry(const std::string& path)
+{
+  const auto slash = path.rfind('/');
+  const std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  return name == "." || name == "..";
+}
+
+// Appends all regular files below path to files.
+void collect_files(const std::string& path, std::vector<std::string>& files)
+{
+  for(auto& entry : directory_entries(path)) {
+    if(is_dot_entry(entry)) continue;
+    if(is_directory(entry)) collect_files(entry, files);
+    else files.push_back(std::move(entry));
+  }
+}
+} // anonymous namespace
+
+DirectoryWatcher::DirectoryWatcher(const std::string& path, bool recursive)
+  : fd_(inotify_init1(IN_CLOEXEC))
+  , recursive_(recursive)
+  , root_(path)
+  , buf_(64 * (sizeof(inotify_event) + NAME_MAX + 1))
+{
+  if(fd_ < 0) throw posix_error(errno);
+  try {
+    add_watch(path);
+  } catch(...) {
+    close(fd_);
+    throw;
+  }
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+  close(fd_); // also removes all watches
+}
+
+// Watches path and, if recursive, all its subdirectories.
+void DirectoryWatcher::add_watch(const std::string& path)
+{
+  const int wd = inotify_add_watch(fd_, path.c_str(),
+				   FILE_EVENTS | (recursive_ ? DIR_EVENTS : 0) | IN_ONLYDIR);
+  if(wd < 0) throw posix_error(errno);
+  watches_[wd] = path;
+  if(!recursive_) return;
+
+  for(const auto& entry : directory_entries(path)) {
+    if(!is_dot_entry(entry) && is_directory(entry)) add_watch(entry);
+  }
+}
+
+std::vector<std::string> DirectoryWatcher::wait(int timeout_ms)
+{
+  std::vector<std::string> files;
+  pollfd p = { fd_, POLLIN, 0 };
+  const int rc = poll(&p, 1, timeout_ms);
+  if(rc < 0 && errno != EINTR) throw posix_error(errno);
+  if(rc <= 0) return files;
+
+  const ssize_t n = read(fd_, buf_.data(), buf_.size());
+  if(n < 0) {
+    if(errno == EINTR || errno == EAGAIN) return files;
+    throw posix_error(errno);
+  }
+
+  // the kernel only ever returns complete events
+  for(const char* p = buf_.data(); p < buf_.data() + n; ) {
+    const auto* event = reinterpret_cast<const inotify_event*>(p);
+    p += sizeof(inotify_event) + event->len;
+
+    if(event->mask & IN_Q_OVERFLOW) { // events were dropped, wd is -1
+      overflow_ = true;
+      // subdirectories created meanwhile aren't watched yet
+      if(recursive_) {
+	try {
+	  add_watch(root_);
+	} catch(const posix_error&) {
+	  // root is gone, nothing left to watch
+	}
+      }
+      continue;
+    }
+    if(event->mask & IN_IGNORED) { // directory was removed
+      watches_.erase(event->wd);
+      continue;
+    }
+    const auto dir = watches_.find(event->wd);
+    if(dir == watches_.end() || !event->len) continue;
+
+    const std::string path = dir->second + '/' + event->name;
+    if(event->mask & IN_ISDIR) {
+      // a new subdirectory: watch it and pick up whatever it already
+      // contains as it might have been filled before the watch existed
+      if(recursive_ && (event->mask & DIR_EVENTS)) {
+	try {
+	  add_watch(path);
+	  collect_files(path, files);
+	} catch(const posix_error&) {
+	  // already gone again, nothing to do
+	}
+      }
+    } else if(event->mask & FILE_EVENTS) {
+      files.push_back(path);
+    }
+  }
+  return files;
+}
+
+bool DirectoryWatcher::take_overflow()
+{
+  const bool overflow = overflow_;
+  overflow_ = false;
+  return overflow;
+}
+
+std::vector<std::string> DirectoryWatcher::directories() const
+{
+  std::vector<std::string> dirs;
+  for(const auto& w : watches_) dirs.push_back(w.second);
+  return dirs;
+}
+#else
+DirectoryWatcher::DirectoryWatcher(const std::string&, bool)
+  : fd_(-1)
+  , recursive_(false)
+{
+  throw std::runtime_error("Watching directories is only supported on Linux");
+}
+
+DirectoryWatcher::~DirectoryWatcher() {}
+std::vector<std::string> DirectoryWatcher::wait(int) { return {}; }
+bool DirectoryWatcher::take_overflow() { return false; }
+std::vector<std::string> DirectoryWatcher::directories() const { return {}; }
+void DirectoryWatcher::add_watch(const std::string&) {}
+#endif // __linux__
+
+} // namespace vscharf
+
+#ifdef TEST_WATCH
+// some basic unit testing
+#include <cassert>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+int main()
+{
+  char tmpl[] = "/tmp/watch_test_XXXXXX";
+  const std::string dir = mkdtemp(tmpl);
+  const std::string subdir = dir + "/sub";
+  mkdir(subdir.c_str(), 0755);
+
+  {
+    vscharf::DirectoryWatcher flat(dir, false);
+    vscharf::DirectoryWatcher deep(dir, true);
+    assert(flat.directories().size() == 1);
+    assert(deep.directories().size() == 2);
+
+    // nothing happened yet
+    assert(flat.wait(0).empty());
+
+    // a file is only reported after it has been closed
+    std::ofstream out(dir + "/a.wav");
+    out << "data";
+    out.flush();
+    assert(flat.wait(0).empty());
+    out.close();
+    auto files = flat.wait(1000);
+    assert(files.size() == 1 && files[0] == dir + "/a.wav");
+    files = deep.wait(1000);
+    assert(files.size() == 1 && files[0] == dir + "/a.wav");
+
+    // files in subdirectories only for the recursive watcher
+    std::ofstream(subdir + "/b.wav") << "data";
+    assert(flat.wait(0).empty());
+    files = deep.wait(1000);
+    assert(files.size() == 1 && files[0] == subdir + "/b.wav");
+
+    // new subdirectories are watched as well
+    const std::string newdir = dir + "/new";
+    mkdir(newdir.c_str(), 0755);
+    assert(deep.wait(1000).empty());
+    assert(deep.directories().size() == 3);
+    std::ofstream(newdir + "/c.wav") << "data";
+    files = deep.wait(1000);
+    assert(files.size() == 1 && files[0] == newdir + "/c.wav");
+    assert(!deep.take_overflow());
+  }
+
+  {
+    // more completed files than the kernel queues events for
+    vscharf::DirectoryWatcher flat(dir, false);
+    std::size_t max_events = 16384;
+    std::ifstream("/proc/sys/fs/inotify/max_queued_events") >> max_events;
+    if(max_events <= 100000) {
+      for(std::size_t i = 0; i <= max_events; ++i) {
+	std::ofstream(dir + "/f" + std::to_string(i));
+      }
+      std::size_t reported = 0;
+      for(auto files = flat.wait(1000); !files.empty(); files = flat.wait(0)) reported += files.size();
+      assert(reported <= max_events);
+      assert(flat.take_overflow());
+      assert(!flat.take_overflow());
+    }
+  }
+
+  std::system(("rm -rf " + dir).c_str());
+  std::cout << "Test finished successfully!" << std::endl;
+  return 0;
+}
+#endif // TEST_WATCH
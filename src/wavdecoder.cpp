@@ -1,67 +1,117 @@
 #include "wavdecoder.h"
 
-#include <algorithm> // generate_n
-#include <exception> // terminate
-#include <iterator> // istream_iterator
-#include <string>
-#include <utility> // swap
+#include <algorithm> // min, transform
+#include <cassert>
+#include <cstring> // memcpy, memcmp, memmove
+#include <limits>
 
 namespace vscharf {
 
-// constexpr bool little_endian()
-// {
-//   return ((char*)endiadness)[0] == 0xDD;
-// }
-
 // ======== helper functions ========
 namespace {
 
-constexpr static uint32_t endiadness{0xAABBCCDD};
+// RIFF stores all integers little-endian, independent of the host
+inline uint16_t le16(const unsigned char* p) { return p[0] | p[1] << 8; }
+inline uint32_t le32(const unsigned char* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+inline bool is_id(const unsigned char* p, const char* id) { return !std::memcmp(p, id, 4); }
+
+// State of a walk over the RIFF chunk table. Offsets are relative to
+// the beginning of the file.
+struct ChunkScan {
+  uint64_t next = 12;       // header of the next chunk, after "RIFF" size "WAVE"
+  bool has_format = false;
+  WavDecoder::WavHeader header;
+  bool has_data = false;    // only data chunks after the format count
+  uint64_t data_offset = 0; // payload of the first data chunk
+  uint32_t data_size = 0;
+  uint64_t frames = 0;      // whole frames in all data chunks
+};
 
-inline bool is_little_endian() {
-  return ((unsigned char*)&endiadness)[0] == 0xDD;
+const char* check_riff(const unsigned char* p, std::size_t size)
+{
+  if(size < 12 || !is_id(p, "RIFF")) return "No RIFF file";
+  if(!is_id(p + 8, "WAVE")) return "No WAVE type";
+  return nullptr;
 }
 
-template<typename Result>
-inline Result read_integral(std::istream& in)
+// Decodes the first 16 bytes of a format chunk. File Specification
+// taken from
+// http://www-mmsp.ece.mcgill.ca/Documents/AudioFormats/WAVE/WAVE.html
+const char* decode_format(const unsigned char* p, WavDecoder::WavHeader& header)
 {
-  static_assert(std::is_integral<Result>::value, "only integral types");
-  static thread_local std::string bytes(sizeof(Result), 0);
-  in.read(&bytes[0], sizeof(Result));  // explictely allowed since C++11
-  if(!is_little_endian()) {
-    switch(sizeof(Result)) {
-    case 1:
-      break;
-    case 2:
-      std::swap(bytes[0], bytes[1]);
-      break;
-    case 4:
-      std::swap(bytes[0], bytes[3]);
-      std::swap(bytes[1], bytes[2]);
-      break;
-    case 8:
-      std::swap(bytes[0], bytes[7]);
-      std::swap(bytes[1], bytes[6]);
-      std::swap(bytes[2], bytes[5]);
-      std::swap(bytes[3], bytes[4]);
-      break;
-    default:
-      std::terminate();
-    }
+  if(le16(p) != 0x1) return "No PCM format";
+  header.channels = le16(p + 2);
+  header.samplesPerSec = le32(p + 4);
+  header.avgBytesPerSec = le32(p + 8);
+  header.blockAlign = le16(p + 12);
+  header.bitsPerSample = le16(p + 14);
+  if(!header.channels) return "No channels";
+  if(!header.samplesPerSec) return "Invalid sample rate";
+
+  // sample size is M-byte with M = block-align / Nchannels
+  header.bytesPerSample = header.blockAlign / header.channels;
+  if((header.bitsPerSample != 8 && header.bitsPerSample != 16) ||
+     header.bytesPerSample * 8 != header.bitsPerSample) {
+    return "Resolution not supported.";
   }
-  return *reinterpret_cast<const Result*>(bytes.data());
-} // read_integral
+  return nullptr;
+}
 
-template<std::size_t Width>
-inline std::string read_string(std::istream& in)
+// Walks the chunks whose headers lie in buf, which holds the bytes
+// [base, base + size) of the file, starting at s.next. With
+// stop_at_data the walk ends at the first data chunk (s.next is left
+// pointing to it), otherwise the frames of all data chunks are
+// counted. A walk that runs out of buffer leaves s.next at the first
+// chunk not (completely) parsed. Returns an error message or nullptr.
+const char* scan_chunks(const unsigned char* buf, std::size_t size, uint64_t base, bool stop_at_data,
+			ChunkScan& s)
 {
-  std::string bytes(Width, 0);
-  in.read(&bytes[0], Width); // explictely allowed since C++11
-  return bytes;
-} // read_string
+  const uint64_t end = base + size;
+  while(s.next + 8 <= end) {
+    const unsigned char* ck = buf + (s.next - base);
+    const uint32_t ck_size = le32(ck + 4);
+    const uint64_t payload = s.next + 8;
+    if(!s.has_format && is_id(ck, "fmt ")) {
+      if(ck_size < 16) return "Format chunk too short";
+      if(payload + 16 > end) return nullptr; // needs more input
+      if(const char* error = decode_format(buf + (payload - base), s.header)) return error;
+      s.has_format = true;
+    } else if(s.has_format && is_id(ck, "data")) {
+      if(!s.has_data) {
+	s.has_data = true;
+	s.data_offset = payload;
+	s.data_size = ck_size;
+      }
+      if(stop_at_data) return nullptr;
+      const uint64_t available = std::min<uint64_t>(ck_size, end - payload);
+      s.frames += available / (s.header.bytesPerSample * s.header.channels);
+    }
+    s.next = payload + ck_size + (ck_size & 1);
+  }
+  return nullptr;
+}
 
 } // anonymous namespace
 
+WavInfo probe_wav(const char* data, std::size_t size)
+{
+  const auto p = reinterpret_cast<const unsigned char*>(data);
+  ChunkScan s;
+  const char* error = check_riff(p, size);
+  if(!error) error = scan_chunks(p, size, 0, false, s);
+  if(error) throw decoder_error(error);
+  if(!s.has_format) throw decoder_error("No format chunk");
+  if(!s.has_data) throw decoder_error("Couldn't find data chunk!");
+
+  WavInfo info;
+  info.header = s.header;
+  info.frames = s.frames;
+  info.duration_ms = 1000 * s.frames / s.header.samplesPerSec;
+  return info;
+}
+
 // Constructs a WavDecoder object, fills the WavHeader and seeks to
 // the first data chunk.
 WavDecoder::WavDecoder(std::istream& in) : in_(in)
@@ -70,99 +120,194 @@ WavDecoder::WavDecoder(std::istream& in) : in_(in)
   decode_wav_header();
 }
 
-// Skips the next chunk of the wave file. Assumes that the ckID has
-// already been read and the next 4 bytes contain the chunk size.
-void WavDecoder::skip_chunk()
-{
-  auto chunk_size = read_integral<uint32_t>(in_);
-  in_.ignore(chunk_size);
-}
-
-// Decodes the RIFF/WAVE header and fills the information into
-// header_.  File Specification taken from
-// http://www-mmsp.ece.mcgill.ca/Documents/AudioFormats/WAVE/WAVE.html
+// Reads the beginning of the file into head_ and parses the chunk
+// table from there up to the first data chunk. Only if that isn't
+// contained in head_ the buffer is refilled from the next unparsed
+// chunk on.
 void WavDecoder::decode_wav_header()
 {
-  if(read_string<4>(in_) != "RIFF") throw decoder_error("No RIFF file");
-  uint32_t in_size = read_integral<uint32_t>(in_);
-  if(read_string<4>(in_) != "WAVE") throw decoder_error("No WAVE type");
+  const auto head = reinterpret_cast<const unsigned char*>(head_);
+  in_.read(head_, sizeof(head_));
+  head_end_ = in_.gcount();
+  const char* error = check_riff(head, head_end_);
+  if(error) throw decoder_error(error);
 
-  while(in_.good() && read_string<4>(in_) != "fmt ") skip_chunk();
-  if(!in_.good()) throw decoder_error("No format chunk");
+  ChunkScan s;
+  uint64_t base = 0; // file offset of head_[0]
+  while(1) {
+    if((error = scan_chunks(head, head_end_, base, true, s))) throw decoder_error(error);
+    if(s.has_data) break;
+    if(!in_) throw decoder_error(s.has_format ? "Couldn't find data chunk!" : "No format chunk");
 
-  auto fmt_chunk_size = read_integral<uint32_t>(in_);
+    const uint64_t end = base + head_end_;
+    std::size_t keep = 0; // a chunk header (or format) cut by the end of head_
+    if(s.next < end) {
+      keep = end - s.next;
+      std::memmove(head_, head_ + (s.next - base), keep);
+    } else {
+      head_pos_ = head_end_; // all of head_ is parsed
+      skip_bytes(s.next - end);
+    }
+    base = s.next;
+    in_.read(head_ + keep, sizeof(head_) - keep);
+    head_end_ = keep + in_.gcount();
+  }
 
-  if(read_integral<uint16_t>(in_) != 0x1) throw decoder_error("No PCM format");
-  header_.channels = read_integral<uint16_t>(in_);
-  header_.samplesPerSec = read_integral<uint32_t>(in_);
-  header_.avgBytesPerSec = read_integral<uint32_t>(in_);
-  header_.blockAlign = read_integral<uint16_t>(in_);
-  header_.bitsPerSample = read_integral<uint16_t>(in_);
+  header_ = s.header;
+  head_pos_ = s.data_offset - base;
+  remaining_chunk_size_ = s.data_size;
+  chunk_padded_ = s.data_size & 1;
+}
 
-  // sample size is M-byte with M = block-align / Nchannels
-  header_.bytesPerSample = header_.blockAlign / header_.channels;
-  
-  // skip the rest of the fmt header ...
-  in_.ignore(fmt_chunk_size - 16);
+// Reads n bytes, from head_ as long as it has some left. Returns
+// fewer at the end of the file.
+std::size_t WavDecoder::read_bytes(char* dst, std::size_t n)
+{
+  const std::size_t buffered = std::min(n, head_end_ - head_pos_);
+  if(buffered) std::memcpy(dst, head_ + head_pos_, buffered);
+  head_pos_ += buffered;
+  if(buffered == n) return n;
+  in_.read(dst + buffered, n - buffered);
+  return buffered + in_.gcount();
 }
 
-// Moves the current read position of in_ to point to the size of a
-// data chunk. Assumes the file position is directly before the
-// beginning of a new chunk, i.e. the next 4 bytes are the ckID.
-void WavDecoder::seek_data()
+void WavDecoder::skip_bytes(uint64_t n)
 {
-  in_.peek(); // make sure eof is set properly if we are at the end of the file
-  while(in_.good() && read_string<4>(in_) != "data") skip_chunk();
-  if(!in_) throw decoder_error("Couldn't find data chunk!");
+  const std::size_t buffered = std::min<uint64_t>(n, head_end_ - head_pos_);
+  head_pos_ += buffered;
+  n -= buffered;
+  const uint64_t step = std::numeric_limits<std::streamsize>::max();
+  for(; n && in_; n -= std::min(n, step)) in_.ignore(std::min(n, step));
 }
 
-// Read the next sample from the current data chunk. Seek the next
-// chunk if the current chunk is finished.
-const WavDecoder::char_buffer& WavDecoder::read_samples(uint32_t nsamples)
+// Makes sure the read position is inside a data chunk with at least
+// one frame left. Skips the rest of the current chunk and any other
+// chunks otherwise. Returns false if the file is finished; an
+// incomplete chunk header at the end is ignored.
+bool WavDecoder::next_data_chunk()
 {
-  if(!remaining_chunk_size_) {
-    seek_data();
-    if(in_.eof()) { // file finished
-      buf_.resize(0);
-      return buf_;
-    }
+  const uint32_t frame_bytes = header_.bytesPerSample * header_.channels;
+  while(remaining_chunk_size_ < frame_bytes) {
+    skip_bytes(static_cast<uint64_t>(remaining_chunk_size_) + chunk_padded_);
+    remaining_chunk_size_ = 0;
+    chunk_padded_ = false;
 
-    // read chunk size
-    remaining_chunk_size_ = read_integral<uint32_t>(in_);
-    if(!remaining_chunk_size_) throw decoder_error("Empty data chunk!");
+    unsigned char ck[8];
+    if(read_bytes(reinterpret_cast<char*>(ck), sizeof(ck)) < sizeof(ck)) return false;
+    const uint32_t ck_size = le32(ck + 4);
+    if(is_id(ck, "data")) {
+      remaining_chunk_size_ = ck_size;
+      chunk_padded_ = ck_size & 1;
+    } else {
+      skip_bytes(static_cast<uint64_t>(ck_size) + (ck_size & 1));
+    }
   }
+  return true;
+}
 
-  // make sure there is enough space in the buffer to accomodate nsamples
-  buf_.resize(nsamples * header_.channels, 0);
+// Reads up to frames frames of the current data chunk into dst, which
+// has to hold frames * frame_bytes bytes. Returns the number of whole
+// frames read, a truncated file ends the chunk.
+uint32_t WavDecoder::read_frames(char* dst, uint32_t frames, uint32_t frame_bytes)
+{
+  const uint32_t bytes = frames * frame_bytes;
+  const std::size_t n = read_bytes(dst, bytes);
+  if(n < bytes) {
+    remaining_chunk_size_ = 0;
+    chunk_padded_ = false;
+    return n / frame_bytes;
+  }
+  remaining_chunk_size_ -= bytes;
+  return frames;
+}
 
-  // in case not enough samples are available to fulfill nsamples_
-  if(buf_.size() * header_.bytesPerSample > remaining_chunk_size_) {
-    buf_.resize(remaining_chunk_size_ / header_.bytesPerSample, 0);
+// Read the next sample from the current data chunk. Seek the next
+// chunk if the current chunk is finished. Generic version which
+// handles any supported layout at runtime.
+const WavDecoder::char_buffer& WavDecoder::read_samples(uint32_t nsamples)
+{
+  if(!next_data_chunk()) {
+    buf_.resize(0);
+    return buf_;
   }
 
+  // in case not enough samples are available to fulfill nsamples
+  const uint32_t channels = header_.channels;
+  const uint32_t frame_bytes = header_.bytesPerSample * channels;
+  uint32_t frames = std::min(nsamples, remaining_chunk_size_ / frame_bytes);
+
   if(header_.bitsPerSample == 16) {
     // directly stored as signed short ints, no conversion necessary (except endiadness)
-    in_.read(reinterpret_cast<char*>(&buf_[0]), 2*buf_.size());
-    if(!is_little_endian()) {
+    buf_.resize(frames * channels);
+    frames = read_frames(reinterpret_cast<char*>(buf_.data()), frames, frame_bytes);
+    buf_.resize(frames * channels);
+    if(!host_little_endian) {
       for(int16_t& s : buf_) {
 	s = ((s & 0xFF) << 8) | ((s & 0xFF00) >> 8);
       }
     }
   } else if(header_.bitsPerSample == 8) {
     // stored as unsigned chars --> convert to signed short ints
-    auto input_it = std::istream_iterator<unsigned char>(in_);
-    std::generate_n(buf_.begin(), buf_.size(),
-		    [&input_it]() -> int16_t {
-		      return 257*(*input_it++) - 32768; // [0,255] to [-32768,32767]
-		    });
+    raw_.resize(frames * channels);
+    frames = read_frames(reinterpret_cast<char*>(raw_.data()), frames, frame_bytes);
+    buf_.resize(frames * channels);
+    std::transform(raw_.begin(), raw_.begin() + buf_.size(), buf_.begin(),
+		   [](unsigned char c) -> int16_t {
+		     return 257*c - 32768; // [0,255] to [-32768,32767]
+		   });
   } else {
     throw decoder_error("Resolution not supported.");
   }
 
-  remaining_chunk_size_ -= in_.gcount();
+  return buf_;
+}
+
+// Specialised version of read_samples: channel count, sample width
+// and byte order are compile-time constants, so the loops below have
+// no branches left and can be fully inlined/vectorised.
+template<typename Format>
+const WavDecoder::char_buffer& WavDecoder::read_samples(uint32_t nsamples)
+{
+  assert(matches<Format>());
+  if(!next_data_chunk()) {
+    buf_.resize(0);
+    return buf_;
+  }
+
+  const uint32_t frame_bytes = Format::bytesPerSample * Format::channels;
+  uint32_t frames = std::min(nsamples, remaining_chunk_size_ / frame_bytes);
+
+  if(Format::bitsPerSample == 16) {
+    buf_.resize(frames * Format::channels);
+    frames = read_frames(reinterpret_cast<char*>(buf_.data()), frames, frame_bytes);
+    const uint32_t n = frames * Format::channels;
+    buf_.resize(n);
+    if(Format::needsSwap) {
+      int16_t* const out = buf_.data();
+      for(uint32_t i = 0; i < n; ++i) {
+	out[i] = ((out[i] & 0xFF) << 8) | ((out[i] & 0xFF00) >> 8);
+      }
+    }
+  } else {
+    raw_.resize(frames * Format::channels);
+    frames = read_frames(reinterpret_cast<char*>(raw_.data()), frames, frame_bytes);
+    const uint32_t n = frames * Format::channels;
+    buf_.resize(n);
+    const unsigned char* const in = raw_.data();
+    int16_t* const out = buf_.data();
+    for(uint32_t i = 0; i < n; ++i) {
+      out[i] = 257*in[i] - 32768; // [0,255] to [-32768,32767]
+    }
+  }
 
   return buf_;
 }
+
+// the formats for which specialised paths exist
+template const WavDecoder::char_buffer& WavDecoder::read_samples<PcmFormat<16, 1>>(uint32_t);
+template const WavDecoder::char_buffer& WavDecoder::read_samples<PcmFormat<16, 2>>(uint32_t);
+template const WavDecoder::char_buffer& WavDecoder::read_samples<PcmFormat<8, 1>>(uint32_t);
+template const WavDecoder::char_buffer& WavDecoder::read_samples<PcmFormat<8, 2>>(uint32_t);
   
 } // namespace vscharf
 
@@ -171,6 +316,78 @@ const WavDecoder::char_buffer& WavDecoder::read_samples(uint32_t nsamples)
 #include <cassert>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+namespace {
+void put(std::string& s, uint32_t v, int bytes) {
+  for(int i = 0; i < bytes; ++i) s += static_cast<char>((v >> (8*i)) & 0xFF);
+}
+
+std::string chunk(const char* id, const std::string& payload, uint32_t size) {
+  std::string s(id);
+  put(s, size, 4);
+  s += payload;
+  if(payload.size() & 1) s += '\0'; // pad byte
+  return s;
+}
+std::string chunk(const char* id, const std::string& payload) { return chunk(id, payload, payload.size()); }
+
+std::string fmt(uint16_t channels, uint16_t bits, uint32_t extra = 0) {
+  std::string s;
+  put(s, 1, 2); // PCM
+  put(s, channels, 2);
+  put(s, 8000, 4);
+  put(s, 8000 * channels * bits / 8, 4);
+  put(s, channels * bits / 8, 2);
+  put(s, bits, 2);
+  put(s, 0, extra);
+  return chunk("fmt ", s);
+}
+
+std::string riff(const std::string& chunks) {
+  std::string s("RIFF");
+  put(s, 4 + chunks.size(), 4);
+  return s + "WAVE" + chunks;
+}
+
+// Decodes all samples of wav in blocks of 3 and checks that probe_wav
+// agrees.
+std::vector<int16_t> decode(const std::string& wav) {
+  std::istringstream in(wav);
+  vscharf::WavDecoder w(in);
+  std::vector<int16_t> samples;
+  while(w.has_next()) {
+    const auto& buf = w.read_samples(3);
+    samples.insert(samples.end(), buf.begin(), buf.end());
+  }
+  const auto info = vscharf::probe_wav(wav.data(), wav.size());
+  assert(info.header.channels == w.get_header().channels);
+  assert(info.frames * info.header.channels == samples.size());
+  return samples;
+}
+
+// The message of the decoder_error both WavDecoder and probe_wav throw
+// for wav.
+std::string error_of(const std::string& wav) {
+  std::string decoder, probe;
+  try {
+    std::istringstream in(wav);
+    vscharf::WavDecoder w(in);
+  } catch(const vscharf::decoder_error& e) {
+    decoder = e.what();
+  }
+  try {
+    vscharf::probe_wav(wav.data(), wav.size());
+  } catch(const vscharf::decoder_error& e) {
+    probe = e.what();
+  }
+  assert(decoder == probe);
+  return decoder;
+}
+} // anonymous namespace
+
 int main(int argc, char* argv[]) {
   std::ifstream input_file("test_data/sound.wav");
   vscharf::WavDecoder w(input_file);
@@ -194,6 +411,275 @@ int main(int argc, char* argv[]) {
   std::cout << nsamples << std::endl;
   assert(nsamples == 0x10266 / 2);
 
+  {
+    // the specialised path has to decode exactly like the generic one
+    using Format = vscharf::PcmFormat<16, 1>;
+    std::ifstream generic_file("test_data/sound.wav");
+    std::ifstream special_file("test_data/sound.wav");
+    vscharf::WavDecoder generic(generic_file);
+    vscharf::WavDecoder special(special_file);
+    assert(special.matches<Format>());
+    assert((!special.matches<vscharf::PcmFormat<16, 2>>()));
+    while(generic.has_next()) {
+      const auto& g = generic.read_samples(100);
+      assert(special.has_next());
+      const auto& s = special.read_samples<Format>(100);
+      assert(g == s);
+    }
+    assert(!special.has_next());
+  }
+
+  {
+    // probing the whole file gives the decoded length
+    std::ifstream in("test_data/sound.wav", std::ios::binary);
+    const std::string wav((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const auto info = vscharf::probe_wav(wav.data(), wav.size());
+    assert(info.header.samplesPerSec == 44100);
+    assert(info.frames == 0x10266 / 2);
+    assert(info.duration_ms == 750);
+  }
+
+  {
+    // odd-sized chunks are padded, partial frames dropped, several
+    // data chunks concatenated
+    const std::string wav = riff(chunk("LIST", "abc") + fmt(1, 8) + chunk("data", std::string(5, '\x80')) +
+				 chunk("junk", "x") + chunk("data", std::string("\xff\x00\x80", 3)));
+    const auto samples = decode(wav);
+    assert(samples.size() == 8);
+    assert(samples[0] == 128 && samples[5] == 32767 && samples[6] == -32768);
+
+    const auto stereo = decode(riff(fmt(2, 16) + chunk("data", std::string("\x01\x00\x02\x00\x03\x00\x04", 7))));
+    assert(stereo.size() == 2 && stereo[0] == 1 && stereo[1] == 2);
+  }
+
+  {
+    // fmt with cbSize, data before fmt ignored, empty and truncated
+    // data chunks
+    const auto samples = decode(riff(chunk("data", "zz") + fmt(1, 16, 2) + chunk("data", "") +
+				     chunk("data", std::string("\x01\x00\x02\x00\x03", 5), 100)));
+    assert(samples.size() == 3 && samples[1] == 2); // the pad byte completes the last one
+  }
+
+  {
+    // chunks before the data larger than the header buffer
+    const std::string wav = riff(chunk("LIST", std::string(10001, 'x')) + fmt(1, 16) +
+				 chunk("bext", std::string(5000, 'y')) + chunk("data", std::string(20, '\0')));
+    assert(decode(wav).size() == 10);
+  }
+
+  // malformed headers
+  assert(error_of("") == "No RIFF file");
+  assert(error_of(riff("").replace(8, 4, "AVI ")) == "No WAVE type");
+  assert(error_of(riff(chunk("fmt ", std::string("\x01\x00", 2)) + chunk("data", "ab"))) == "Format chunk too short");
+  assert(error_of(riff(chunk("fmt ", std::string(16, '\0'), 16))) == "No PCM format");
+  assert(error_of(riff(fmt(0, 16) + chunk("data", "ab"))) == "No channels");
+  assert(error_of(riff(fmt(1, 24) + chunk("data", "abc"))) == "Resolution not supported.");
+  assert(error_of(riff(fmt(1, 16).substr(0, 20))) == "No format chunk");
+  assert(error_of(riff(chunk("data", "ab") + fmt(1, 16) + chunk("LIST", "abc"))) == "Couldn't find data chunk!");
+  assert(error_of(riff(fmt(1, 16) + "dat")) == "Couldn't find data chunk!");
+
   std::cout << "Test finished successfully!" << std::endl;
 }
 #endif // TEST_WAV
+
+#ifdef FUZZ_WAV
+// libFuzzer entry point: decoder and probe have to agree on every
+// input, the specialised paths have to decode like the generic one.
+//   clang++ -std=c++11 -Iinclude -g -O1 -fsanitize=fuzzer,address,undefined -DFUZZ_WAV src/wavdecoder.cpp
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+namespace {
+template<typename Format>
+void compare_paths(const std::string& wav)
+{
+  std::istringstream generic_in(wav), special_in(wav);
+  vscharf::WavDecoder generic(generic_in), special(special_in);
+  if(!special.matches<Format>()) return;
+  while(generic.has_next()) {
+    if(!special.has_next()) std::abort();
+    const auto& g = generic.read_samples(7);
+    if(g != special.read_samples<Format>(7)) std::abort();
+  }
+  if(special.has_next() && !special.read_samples<Format>(7).empty()) std::abort();
+}
+} // anonymous namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, std::size_t size)
+{
+  const std::string wav(reinterpret_cast<const char*>(data), size);
+  vscharf::WavInfo info;
+  std::string probe_error;
+  try {
+    info = vscharf::probe_wav(wav.data(), wav.size());
+  } catch(const vscharf::decoder_error& e) {
+    probe_error = e.what();
+  }
+
+  try {
+    std::istringstream in(wav);
+    vscharf::WavDecoder w(in);
+    if(!probe_error.empty()) std::abort();
+    const auto& h = w.get_header();
+    if(h.channels != info.header.channels || h.samplesPerSec != info.header.samplesPerSec ||
+       h.bytesPerSample != info.header.bytesPerSample) std::abort();
+    uint64_t nsamples = 0;
+    while(w.has_next()) nsamples += w.read_samples(1000).size();
+    if(nsamples != info.frames * h.channels) std::abort();
+  } catch(const vscharf::decoder_error& e) {
+    if(probe_error != e.what()) std::abort();
+    return 0;
+  }
+
+  compare_paths<vscharf::PcmFormat<16, 1>>(wav);
+  compare_paths<vscharf::PcmFormat<16, 2>>(wav);
+  compare_paths<vscharf::PcmFormat<8, 1>>(wav);
+  compare_paths<vscharf::PcmFormat<8, 2>>(wav);
+  return 0;
+}
+#endif // FUZZ_WAV
+
+#ifdef BENCH_WAV
+// compares the generic decoding path with the specialised ones on
+// synthetic in-memory WAV files
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+namespace {
+void put(std::string& s, uint32_t v, int bytes) {
+  for(int i = 0; i < bytes; ++i) s += static_cast<char>((v >> (8*i)) & 0xFF);
+}
+
+std::string make_wav(uint16_t bits, uint16_t channels, uint32_t rate, uint32_t frames) {
+  const uint32_t block_align = channels * bits / 8;
+  const uint32_t data_size = frames * block_align;
+  std::string s("RIFF");
+  put(s, 36 + data_size, 4);
+  s += "WAVEfmt ";
+  put(s, 16, 4);
+  put(s, 1, 2); // PCM
+  put(s, channels, 2);
+  put(s, rate, 4);
+  put(s, rate * block_align, 4);
+  put(s, block_align, 2);
+  put(s, bits, 2);
+  s += "data";
+  put(s, data_size, 4);
+  for(uint32_t i = 0; i < data_size; ++i) s += static_cast<char>(i * 31);
+  return s;
+}
+
+// Header-only files with a varying chunk table: odd-sized LIST
+// chunks before and after the format, format chunks with cbSize.
+std::vector<std::string> make_headers(std::size_t count) {
+  std::vector<std::string> headers;
+  for(std::size_t i = 0; i < count; ++i) {
+    std::string chunks;
+    for(std::size_t k = 0; k < i % 3; ++k) {
+      const uint32_t size = (i * 37 + k * 101) % 512;
+      chunks += "LIST";
+      put(chunks, size, 4);
+      chunks.append(size + (size & 1), 'x');
+    }
+    const uint16_t channels = 1 + i % 2;
+    const uint32_t fmt_size = i % 4 ? 16 : 18;
+    chunks += "fmt ";
+    put(chunks, fmt_size, 4);
+    put(chunks, 1, 2); // PCM
+    put(chunks, channels, 2);
+    put(chunks, 44100, 4);
+    put(chunks, 44100 * channels * 2, 4);
+    put(chunks, channels * 2, 2);
+    put(chunks, 16, 2);
+    chunks.append(fmt_size - 16, '\0');
+    if(i % 5 == 0) {
+      chunks += "fact";
+      put(chunks, 4, 4);
+      put(chunks, 0, 4);
+    }
+    chunks += "data";
+    put(chunks, 64, 4);
+    chunks.append(64, '\0');
+    std::string s("RIFF");
+    put(s, 4 + chunks.size(), 4);
+    headers.push_back(s + "WAVE" + chunks);
+  }
+  return headers;
+}
+
+// Compares probe_wav with constructing a WavDecoder (which parses the
+// same chunk table from a stream).
+void compare_headers() {
+  const auto headers = make_headers(4096);
+  const int repetitions = 50;
+  uint64_t checksum_probe = 0, checksum_decoder = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for(int r = 0; r < repetitions; ++r) {
+    for(const auto& h : headers) checksum_probe += vscharf::probe_wav(h.data(), h.size()).frames;
+  }
+  std::chrono::duration<double> probe = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for(int r = 0; r < repetitions; ++r) {
+    for(const auto& h : headers) {
+      std::istringstream in(h);
+      vscharf::WavDecoder w(in);
+      checksum_decoder += 32 / w.get_header().channels;
+    }
+  }
+  std::chrono::duration<double> decoder = std::chrono::steady_clock::now() - start;
+
+  const double n = double(headers.size()) * repetitions;
+  std::cout << "headers: probe " << n / probe.count() << " headers/s, decoder "
+	    << n / decoder.count() << " headers/s"
+	    << (checksum_probe == checksum_decoder ? "" : " CHECKSUM MISMATCH")
+	    << std::endl;
+}
+
+template<typename Format, bool Specialised>
+double run(const std::string& wav, int repetitions, uint64_t& checksum) {
+  auto start = std::chrono::steady_clock::now();
+  for(int r = 0; r < repetitions; ++r) {
+    std::istringstream in(wav);
+    vscharf::WavDecoder w(in);
+    while(w.has_next()) {
+      const auto& buf = Specialised ? w.read_samples<Format>(2048) : w.read_samples(2048);
+      if(!buf.empty()) checksum += static_cast<uint16_t>(buf.back());
+    }
+  }
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  return d.count();
+}
+
+template<typename Format>
+void compare(const char* name, uint32_t rate) {
+  const uint32_t frames = rate * 10; // 10 seconds of audio
+  const int repetitions = 20;
+  const std::string wav = make_wav(Format::bitsPerSample, Format::channels, rate, frames);
+  uint64_t checksum_generic = 0, checksum_special = 0;
+  double generic = run<Format, false>(wav, repetitions, checksum_generic);
+  double special = run<Format, true>(wav, repetitions, checksum_special);
+  const double audio = double(frames) * repetitions / rate;
+  std::cout << name << " @ " << rate << " Hz: generic " << audio / generic
+	    << " audio-s/s, specialised " << audio / special
+	    << " audio-s/s (x" << generic / special << ")"
+	    << (checksum_generic == checksum_special ? "" : " CHECKSUM MISMATCH")
+	    << std::endl;
+}
+} // anonymous namespace
+
+int main() {
+  using namespace vscharf;
+  compare<PcmFormat<16, 1>>("s16 mono  ", 44100);
+  compare<PcmFormat<16, 2>>("s16 stereo", 44100);
+  compare<PcmFormat<16, 1>>("s16 mono  ", 48000);
+  compare<PcmFormat<16, 2>>("s16 stereo", 48000);
+  compare<PcmFormat<8, 1>>("u8 mono   ", 44100);
+  compare<PcmFormat<8, 2>>("u8 stereo ", 44100);
+  compare_headers();
+  return 0;
+}
+#endif // BENCH_WAV